@@ -1,5 +1,42 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
-#include "toyvm.h"
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "minvm.h"
+
+/*******************************************************************************
+* One guest run of the batch mode. In --inputs= mode every job runs the same  *
+* program on its own input file, otherwise every job runs its own program.     *
+*******************************************************************************/
+typedef struct job {
+    const char* program_path;
+    const char* input_path;   /* NULL unless in --inputs= mode.    */
+    char*       text;         /* What the guest printed, then its  *
+                               * status if it faulted.             */
+    size_t      length;
+    uint64_t    instructions;
+    bool        failed;       /* The file was unreadable or the    *
+                               * guest faulted.                    */
+    bool        done;         /* Guarded by 'batch.lock'.          */
+} job;
+
+static struct {
+    job*            jobs;
+    size_t          n_jobs;
+    atomic_size_t   next;
+    VM_IMAGE        image;    /* The program in --inputs= mode.    */
+    bool            has_image;
+    int             engine;
+    pthread_mutex_t lock;
+    pthread_cond_t  finished;
+} batch = {
+    .lock     = PTHREAD_MUTEX_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
 
 static size_t getFileSize(FILE* file)
 {
@@ -10,13 +47,1034 @@ static size_t getFileSize(FILE* file)
     return size;
 }
 
+//data_size 字节的程序和数据加上同样大的栈，内存大小能否用 vm_address 表示
+static bool fitsInMemory(size_t data_size)
+{
+    return data_size <= ((vm_unsigned_address) -1 >> 1) / 2;
+}
+
+//把整个文件读入内存，失败时返回 NULL
+static uint8_t* readFile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "r");
+    
+    if (!file)
+    {
+        return NULL;
+    }
+    
+    *size = getFileSize(file);
+    
+    uint8_t* data = (uint8_t*)malloc(*size + 1);
+    
+    if (data != NULL && fread(data, 1, *size, file) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    
+    fclose(file);
+    return data;
+}
+
+//解析 --engine= 选项，无法识别时返回 -1
+static int parseEngine(const char* name)
+{
+    if (strcmp(name, "auto") == 0)
+    {
+        return ENGINE_AUTO;
+    }
+    
+    if (strcmp(name, "interpreter") == 0)
+    {
+        return ENGINE_INTERPRETER;
+    }
+    
+    if (strcmp(name, "quick") == 0)
+    {
+        return ENGINE_QUICKENING;
+    }
+    
+    return -1;
+}
+
+static bool hasFaulted(const TOYVM* vm)
+{
+    return vm->cpu.status.BAD_ACCESS
+        || vm->cpu.status.BAD_INSTRUCTION
+        || vm->cpu.status.INVALID_REGISTER_INDEX
+        || vm->cpu.status.STACK_OVERFLOW
+        || vm->cpu.status.STACK_UNDERFLOW;
+}
+
+static int comparePaths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+//列出目录中的普通文件，按名字排序；空目录返回空的列表，失败时返回 NULL
+static char** listDirectory(const char* directory, size_t* count)
+{
+    DIR* dir = opendir(directory);
+    size_t capacity = 64;
+    char** paths = dir != NULL ? malloc(capacity * sizeof(char*)) : NULL;
+    
+    if (paths == NULL)
+    {
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+        
+        return NULL;
+    }
+    
+    struct dirent* entry;
+    *count = 0;
+    
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+        char* path = malloc(length);
+        struct stat info;
+        snprintf(path, length, "%s/%s", directory, entry->d_name);
+        
+        if (stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            free(path);
+            continue;
+        }
+        
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            paths = realloc(paths, capacity * sizeof(char*));
+        }
+        
+        paths[(*count)++] = path;
+    }
+    
+    closedir(dir);
+    qsort(paths, *count, sizeof(char*), comparePaths);
+    return paths;
+}
+
+/*******************************************************************************
+* 执行一个作业，输出和出错时的状态写入 job->text。每个工作线程复用同一台虚拟机， *
+* 内存大小与上一个作业相同时只需要 ResetVM；'memory_size' 为 -1 表示虚拟机还没有 *
+* 初始化。程序加载到地址 0，输入紧跟在程序之后，REG1 为输入的地址，REG2 为输入 *
+* 的长度；与单个文件的模式一样，内存的后一半是栈。                             *
+*******************************************************************************/
+static void runJob(TOYVM* vm, vm_address* memory_size, job* j)
+{
+    FILE* output = open_memstream(&j->text, &j->length);
+    size_t program_size = batch.has_image ? batch.image.size : 0;
+    size_t input_size = 0;
+    uint8_t* program = NULL;
+    uint8_t* input = NULL;
+    const char* path = batch.has_image ? j->input_path : j->program_path;
+    
+    if (batch.has_image)
+    {
+        input = readFile(path, &input_size);
+    }
+    else
+    {
+        program = readFile(path, &program_size);
+    }
+    
+    if (program == NULL && input == NULL)
+    {
+        fprintf(output, "ERROR: cannot read file \"%s\".\n", path);
+        fclose(output);
+        j->failed = true;
+        return;
+    }
+    
+    if (!fitsInMemory(program_size + input_size))
+    {
+        fprintf(output, "ERROR: \"%s\" is too large.\n", path);
+        fclose(output);
+        j->failed = true;
+        free(program);
+        free(input);
+        return;
+    }
+    
+    vm_address data_size = (vm_address) (program_size + input_size);
+    
+    if (*memory_size == 2 * data_size)
+    {
+        ResetVM(vm);
+    }
+    else
+    {
+        if (*memory_size >= 0)
+        {
+            FreeVM(vm);
+        }
+        
+        *memory_size = InitializeVM(vm, 2 * data_size, data_size)
+                     ? 2 * data_size
+                     : -1;
+    }
+    
+    if (*memory_size < 0)
+    {
+        fputs("ERROR: out of memory.\n", output);
+        fclose(output);
+        j->failed = true;
+        free(program);
+        free(input);
+        return;
+    }
+    
+    vm->engine = batch.engine;
+    vm->output = output;
+    
+    if (batch.has_image)
+    {
+        LoadVMImage(vm, &batch.image);
+        WriteVMMemoryAt(vm, (vm_address) program_size, input, input_size);
+        vm->cpu.registers[REG1] = (int32_t) program_size;
+        vm->cpu.registers[REG2] = (int32_t) input_size;
+    }
+    else
+    {
+        WriteVMMemory(vm, program, program_size);
+    }
+    
+    RunVM(vm);
+    
+    j->instructions = UINT64_MAX - vm->fuel;
+    
+    if (hasFaulted(vm))
+    {
+        PrintStatus(vm);
+        j->failed = true;
+    }
+    
+    vm->output = stdout;
+    fclose(output);
+    free(program);
+    free(input);
+}
+
+static void* runWorker(void* argument)
+{
+    TOYVM vm;
+    vm_address memory_size = -1;
+    size_t i;
+    
+    while ((i = atomic_fetch_add(&batch.next, 1)) < batch.n_jobs)
+    {
+        runJob(&vm, &memory_size, &batch.jobs[i]);
+        
+        pthread_mutex_lock(&batch.lock);
+        batch.jobs[i].done = true;
+        pthread_cond_broadcast(&batch.finished);
+        pthread_mutex_unlock(&batch.lock);
+    }
+    
+    if (memory_size >= 0)
+    {
+        FreeVM(&vm);
+    }
+    
+    return NULL;
+}
+
+/*******************************************************************************
+* 批处理模式：在 'n_threads' 个线程上执行所有作业，按作业的顺序打印每个作业的  *
+* 输出（一个作业完成且它前面的作业都已打印时就打印），最后在 stderr 上打印吞吐  *
+* 量。                                                                         *
+*******************************************************************************/
+static int runBatch(long n_threads)
+{
+    pthread_t* threads = calloc(n_threads, sizeof(pthread_t));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, runWorker, NULL);
+    }
+    
+    size_t n_failed = 0;
+    uint64_t instructions = 0;
+    
+    for (size_t i = 0; i < batch.n_jobs; ++i)
+    {
+        job* j = &batch.jobs[i];
+        
+        pthread_mutex_lock(&batch.lock);
+        
+        while (!j->done)
+        {
+            pthread_cond_wait(&batch.finished, &batch.lock);
+        }
+        
+        pthread_mutex_unlock(&batch.lock);
+        
+        fwrite(j->text, 1, j->length, stdout);
+        free(j->text);
+        n_failed     += j->failed;
+        instructions += j->instructions;
+    }
+    
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+    free(threads);
+    
+    double elapsed = (end.tv_sec - start.tv_sec)
+                   + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr,
+            "%zu jobs (%zu failed) on %ld threads in %.3f s: "
+            "%.1f jobs/s, %.1f M instructions/s\n",
+            batch.n_jobs, n_failed, n_threads, elapsed,
+            batch.n_jobs / elapsed, instructions / elapsed / 1e6);
+    
+    return n_failed == 0 ? 0 : (EXIT_FAILURE);
+}
+
+/*******************************************************************************
+* Streaming mode: runs one program over every line of a record file. The main *
+* thread reads the records in chunks of STREAM_CHUNK_RECORDS into a ring of    *
+* STREAM_CHUNKS slots while the workers run earlier chunks and the output of   *
+* finished chunks is written, so reading, running and writing overlap. Every   *
+* worker keeps one machine and restores it from a snapshot taken right after   *
+* the program was loaded before each record. With --lanes a worker keeps       *
+* MINVM_LANES machines and runs that many records at a time in lockstep.       *
+*******************************************************************************/
+enum {
+    STREAM_CHUNK_RECORDS = 256,
+    STREAM_CHUNKS        = 64,
+    DEFAULT_RECORD_SIZE  = 4096,
+    
+    CHUNK_FREE = 0,
+    CHUNK_READ,    /* Read, waiting for or being run by a worker.   */
+    CHUNK_DONE,    /* Run, waiting for its output to be written.    */
+};
+
+typedef struct chunk {
+    char*    records;      /* The records, one after another.          */
+    size_t   capacity;
+    size_t   offsets[STREAM_CHUNK_RECORDS + 1]; /* Record i is         *
+                                                 * [offsets[i],        *
+                                                 * offsets[i + 1]).    */
+    size_t   n_records;
+    char*    text;         /* The output of the records, in order.     */
+    size_t   length;
+    int      state;        /* Guarded by 'stream.lock'.                */
+} chunk;
+
+static struct {
+    chunk           chunks[STREAM_CHUNKS];
+    size_t          n_read;    /* Chunks read so far.                  */
+    size_t          n_started; /* Chunks taken by a worker so far.     */
+    bool            end;       /* All records have been read.          */
+    bool            unordered; /* Write chunks as soon as they finish. */
+    bool            collect_reg1;
+    bool            lanes;     /* Run records through RunVMLanes().    */
+    VM_SNAPSHOT     snapshot;
+    vm_address      memory_size;
+    vm_address      stack_limit;
+    size_t          program_size;
+    size_t          record_size;
+    int             engine;
+    char*           line;
+    size_t          line_capacity;
+    size_t          n_records;
+    size_t          n_failed;
+    uint64_t        instructions;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+} stream = {
+    .record_size = DEFAULT_RECORD_SIZE,
+    .lock        = PTHREAD_MUTEX_INITIALIZER,
+    .changed     = PTHREAD_COND_INITIALIZER,
+};
+
+//读入下一块记录，每行一个记录（不含换行符），没有记录时返回 false
+static bool readChunk(FILE* file, chunk* c)
+{
+    size_t size = 0;
+    ssize_t length;
+    c->n_records = 0;
+    
+    if (c->records == NULL)
+    {
+        c->capacity = DEFAULT_RECORD_SIZE;
+        c->records  = malloc(c->capacity);
+    }
+    
+    while (c->n_records < STREAM_CHUNK_RECORDS
+           && (length = getline(&stream.line, &stream.line_capacity, file)) >= 0)
+    {
+        if (length > 0 && stream.line[length - 1] == '\n')
+        {
+            length--;
+        }
+        
+        if (size + length > c->capacity)
+        {
+            c->capacity = 2 * (size + length);
+            c->records  = realloc(c->records, c->capacity);
+        }
+        
+        memcpy(c->records + size, stream.line, length);
+        c->offsets[c->n_records++] = size;
+        size += length;
+    }
+    
+    c->offsets[c->n_records] = size;
+    return c->n_records != 0;
+}
+
+//从快照恢复虚拟机，把记录放在程序之后，记录太长时返回 false
+static bool loadRecord(TOYVM* vm, const char* record, size_t size,
+                       FILE* output)
+{
+    if (size > stream.record_size)
+    {
+        fprintf(output, "ERROR: a record of %zu bytes is longer than "
+                "--record-size.\n", size);
+        return false;
+    }
+    
+    RestoreVMSnapshot(vm, &stream.snapshot);
+    WriteVMMemoryAt(vm,
+                    (vm_address) stream.program_size,
+                    (const uint8_t*) record,
+                    size);
+    
+    vm->cpu.registers[REG1] = (int32_t) stream.program_size;
+    vm->cpu.registers[REG2] = (int32_t) size;
+    vm->output = output;
+    return true;
+}
+
+//统计执行完的记录并输出结果，返回客户机是否出错
+static bool finishRecord(TOYVM* vm, uint64_t* instructions)
+{
+    *instructions += stream.snapshot.fuel - vm->fuel;
+    
+    if (stream.collect_reg1)
+    {
+        fprintf(vm->output, "%d\n", vm->cpu.registers[REG1]);
+    }
+    
+    if (hasFaulted(vm))
+    {
+        PrintStatus(vm);
+        return true;
+    }
+    
+    return false;
+}
+
+//执行一块记录，返回出错的记录数
+static size_t runChunk(TOYVM* vm, const chunk* c, FILE* output,
+                       uint64_t* instructions)
+{
+    size_t n_failed = 0;
+    
+    for (size_t i = 0; i < c->n_records; ++i)
+    {
+        if (!loadRecord(vm,
+                        c->records + c->offsets[i],
+                        c->offsets[i + 1] - c->offsets[i],
+                        output))
+        {
+            n_failed++;
+            continue;
+        }
+        
+        RunVM(vm);
+        n_failed += finishRecord(vm, instructions);
+    }
+    
+    return n_failed;
+}
+
+/*******************************************************************************
+* --lanes 时每次把 MINVM_LANES 个记录交给 RunVMLanes 同步执行。每台虚拟机的输 *
+* 出先写到自己的缓冲区里，一组执行完后再按记录的顺序拼接到块的输出上。         *
+*******************************************************************************/
+static size_t runChunkLanes(TOYVM vms[], const chunk* c, FILE* output,
+                            uint64_t* instructions)
+{
+    FILE*  outputs[MINVM_LANES];
+    char*  texts[MINVM_LANES];
+    size_t lengths[MINVM_LANES];
+    size_t n_failed = 0;
+    
+    for (size_t l = 0; l < MINVM_LANES; ++l)
+    {
+        outputs[l] = open_memstream(&texts[l], &lengths[l]);
+    }
+    
+    for (size_t first = 0; first < c->n_records; first += MINVM_LANES)
+    {
+        TOYVM* group[MINVM_LANES];
+        bool   loaded[MINVM_LANES];
+        size_t n_lanes = 0;
+        size_t count = c->n_records - first < MINVM_LANES
+                     ? c->n_records - first
+                     : MINVM_LANES;
+        
+        for (size_t l = 0; l < count; ++l)
+        {
+            size_t i = first + l;
+            loaded[l] = loadRecord(&vms[l],
+                                   c->records + c->offsets[i],
+                                   c->offsets[i + 1] - c->offsets[i],
+                                   outputs[l]);
+            
+            if (loaded[l])
+            {
+                group[n_lanes++] = &vms[l];
+            }
+        }
+        
+        RunVMLanes(group, n_lanes, stream.program_size);
+        
+        for (size_t l = 0; l < count; ++l)
+        {
+            n_failed += loaded[l] ? finishRecord(&vms[l], instructions) : 1;
+            
+            //刷新后 lengths[l] 是这一组写入的长度，rewind 之后从头复用缓冲区
+            fflush(outputs[l]);
+            fwrite(texts[l], 1, lengths[l], output);
+            rewind(outputs[l]);
+        }
+    }
+    
+    for (size_t l = 0; l < MINVM_LANES; ++l)
+    {
+        vms[l].output = stdout;
+        fclose(outputs[l]);
+        free(texts[l]);
+    }
+    
+    return n_failed;
+}
+
+static void* runStreamWorker(void* argument)
+{
+    size_t n_vms = stream.lanes ? MINVM_LANES : 1;
+    TOYVM* vms = calloc(n_vms, sizeof(TOYVM));
+    
+    for (size_t i = 0; i < n_vms; ++i)
+    {
+        //主线程已经用同样的大小做过快照，这里失败时其他线程多半也会失败
+        if (vms == NULL
+            || !InitializeVM(&vms[i], stream.memory_size, stream.stack_limit))
+        {
+            puts("ERROR: out of memory.");
+            exit(EXIT_FAILURE);
+        }
+        
+        vms[i].engine = stream.engine;
+    }
+    
+    while (true)
+    {
+        pthread_mutex_lock(&stream.lock);
+        
+        while (stream.n_started == stream.n_read && !stream.end)
+        {
+            pthread_cond_wait(&stream.changed, &stream.lock);
+        }
+        
+        if (stream.n_started == stream.n_read)
+        {
+            pthread_mutex_unlock(&stream.lock);
+            break;
+        }
+        
+        chunk* c = &stream.chunks[stream.n_started++ % STREAM_CHUNKS];
+        pthread_mutex_unlock(&stream.lock);
+        
+        FILE* output = open_memstream(&c->text, &c->length);
+        uint64_t instructions = 0;
+        size_t n_failed = stream.lanes
+                        ? runChunkLanes(vms, c, output, &instructions)
+                        : runChunk(vms, c, output, &instructions);
+        
+        vms[0].output = stdout;
+        fclose(output);
+        
+        //不要求顺序时直接输出，一次 fwrite 不会和其他块的输出交错
+        if (stream.unordered)
+        {
+            fwrite(c->text, 1, c->length, stdout);
+            free(c->text);
+        }
+        
+        pthread_mutex_lock(&stream.lock);
+        stream.n_records    += c->n_records;
+        stream.n_failed     += n_failed;
+        stream.instructions += instructions;
+        c->state = stream.unordered ? CHUNK_FREE : CHUNK_DONE;
+        pthread_cond_broadcast(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+    }
+    
+    for (size_t i = 0; i < n_vms; ++i)
+    {
+        FreeVM(&vms[i]);
+    }
+    
+    free(vms);
+    return NULL;
+}
+
+/*******************************************************************************
+* 主线程读入记录并按顺序输出执行完的块；不要求顺序时块由工作线程自己输出，主线 *
+* 程只等待最早的块完成，以便复用它的位置。                                     *
+*******************************************************************************/
+static int runStream(FILE* file, long n_threads)
+{
+    pthread_t* threads = calloc(n_threads, sizeof(pthread_t));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, runStreamWorker, NULL);
+    }
+    
+    size_t n_written = 0;
+    pthread_mutex_lock(&stream.lock);
+    
+    while (!stream.end || n_written < stream.n_read)
+    {
+        chunk* oldest = &stream.chunks[n_written % STREAM_CHUNKS];
+        chunk* next   = &stream.chunks[stream.n_read % STREAM_CHUNKS];
+        
+        if (n_written < stream.n_read && oldest->state == CHUNK_DONE)
+        {
+            pthread_mutex_unlock(&stream.lock);
+            fwrite(oldest->text, 1, oldest->length, stdout);
+            free(oldest->text);
+            pthread_mutex_lock(&stream.lock);
+            oldest->state = CHUNK_FREE;
+            n_written++;
+        }
+        else if (n_written < stream.n_read && oldest->state == CHUNK_FREE)
+        {
+            //工作线程已经输出了这一块
+            n_written++;
+        }
+        else if (!stream.end && next->state == CHUNK_FREE)
+        {
+            pthread_mutex_unlock(&stream.lock);
+            bool has_records = readChunk(file, next);
+            pthread_mutex_lock(&stream.lock);
+            
+            if (has_records)
+            {
+                next->state = CHUNK_READ;
+                stream.n_read++;
+            }
+            else
+            {
+                stream.end = true;
+            }
+            
+            pthread_cond_broadcast(&stream.changed);
+        }
+        else
+        {
+            pthread_cond_wait(&stream.changed, &stream.lock);
+        }
+    }
+    
+    pthread_mutex_unlock(&stream.lock);
+    
+    for (long i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+    free(threads);
+    
+    for (size_t i = 0; i < STREAM_CHUNKS; ++i)
+    {
+        free(stream.chunks[i].records);
+    }
+    
+    free(stream.line);
+    
+    double elapsed = (end.tv_sec - start.tv_sec)
+                   + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr,
+            "%zu records (%zu failed) on %ld threads in %.3f s: "
+            "%.1f records/s, %.1f M instructions/s\n",
+            stream.n_records, stream.n_failed, n_threads, elapsed,
+            stream.n_records / elapsed, stream.instructions / elapsed / 1e6);
+    
+    return stream.n_failed == 0 ? 0 : (EXIT_FAILURE);
+}
+
+/*******************************************************************************
+* 准备流式模式：装入程序，对装好程序的虚拟机做快照，每个工作线程从这个快照开始 *
+* 执行每个记录。与单个文件的模式一样，内存的后一半是栈。                       *
+*******************************************************************************/
+static int streamRecords(const char* program_path, const char* records_path,
+                         long n_threads)
+{
+    size_t program_size;
+    uint8_t* program = readFile(program_path, &program_size);
+    FILE* file = strcmp(records_path, "-") == 0
+               ? stdin
+               : fopen(records_path, "r");
+    
+    if (program == NULL || file == NULL)
+    {
+        printf("ERROR: cannot read file \"%s\".\n",
+               program == NULL ? program_path : records_path);
+        return (EXIT_FAILURE);
+    }
+    
+    if (!fitsInMemory(stream.record_size)
+        || !fitsInMemory(program_size + stream.record_size))
+    {
+        puts("ERROR: the program and a record do not fit in memory.");
+        free(program);
+        
+        if (file != stdin)
+        {
+            fclose(file);
+        }
+        
+        return (EXIT_FAILURE);
+    }
+    
+    VM_IMAGE image;
+    TOYVM vm;
+    vm_address data_size = (vm_address) (program_size + stream.record_size);
+    
+    stream.program_size = program_size;
+    stream.memory_size  = 2 * data_size;
+    stream.stack_limit  = data_size;
+    
+    bool ready = InitializeVM(&vm, stream.memory_size, stream.stack_limit)
+              && CreateVMImage(&image, program, program_size);
+    
+    vm.engine = stream.engine;
+    
+    if (ready)
+    {
+        LoadVMImage(&vm, &image);
+        ready = SnapshotVM(&vm, &stream.snapshot);
+        FreeVMImage(&image);
+    }
+    
+    FreeVM(&vm);
+    free(program);
+    
+    if (!ready)
+    {
+        puts("ERROR: out of memory.");
+        return (EXIT_FAILURE);
+    }
+    
+    int status = runStream(file, n_threads);
+    
+    FreeVMSnapshot(&stream.snapshot);
+    
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    
+    return status;
+}
+
+/*******************************************************************************
+* Checkpointed mode: runs one program in slices of CHECKPOINT_SLICE            *
+* instructions and writes a checkpoint every --checkpoint-interval             *
+* instructions and when asked to stop by SIGTERM or SIGINT, so a long run on   *
+* a host being drained can be continued elsewhere. If the checkpoint exists,   *
+* the run resumes from it instead of starting over; it is removed once the     *
+* guest halts.                                                                 *
+*******************************************************************************/
+enum {
+    CHECKPOINT_SLICE            = 1 << 24,
+    DEFAULT_CHECKPOINT_INTERVAL = 1000000000,
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void requestStop(int signal_number)
+{
+    stop_requested = 1;
+}
+
+static int runCheckpointed(const char* program_path,
+                           const char* checkpoint_path,
+                           int engine,
+                           uint64_t interval)
+{
+    TOYVM vm;
+    FILE* checkpoint = fopen(checkpoint_path, "rb");
+    
+    if (checkpoint != NULL)
+    {
+        fclose(checkpoint);
+        
+        //已有的检查点读不出来时不要从头开始，否则会把它覆盖掉
+        if (!RestoreVM(&vm, checkpoint_path))
+        {
+            printf("ERROR: \"%s\" is not a checkpoint.\n", checkpoint_path);
+            return (EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        size_t program_size;
+        uint8_t* program = readFile(program_path, &program_size);
+        
+        if (program == NULL)
+        {
+            printf("ERROR: cannot read file \"%s\".\n", program_path);
+            return (EXIT_FAILURE);
+        }
+        
+        if (!fitsInMemory(program_size))
+        {
+            printf("ERROR: \"%s\" is too large.\n", program_path);
+            return (EXIT_FAILURE);
+        }
+        
+        if (!InitializeVM(&vm, 2 * program_size, program_size))
+        {
+            puts("ERROR: out of memory.");
+            return (EXIT_FAILURE);
+        }
+        
+        WriteVMMemory(&vm, program, program_size);
+        free(program);
+    }
+    
+    vm.engine = engine;
+    signal(SIGTERM, requestStop);
+    signal(SIGINT, requestStop);
+    
+    uint64_t since_checkpoint = 0;
+    
+    //每一片结束时燃料不为零，说明客户机已经停机或出错
+    for (vm.fuel = CHECKPOINT_SLICE, RunVM(&vm);
+         vm.fuel == 0;
+         vm.fuel = CHECKPOINT_SLICE, RunVM(&vm))
+    {
+        since_checkpoint += CHECKPOINT_SLICE;
+        
+        if (!stop_requested && since_checkpoint < interval)
+        {
+            continue;
+        }
+        
+        fflush(stdout);
+        
+        if (!CheckpointVM(&vm, checkpoint_path))
+        {
+            printf("ERROR: cannot write checkpoint \"%s\".\n",
+                   checkpoint_path);
+            FreeVM(&vm);
+            return (EXIT_FAILURE);
+        }
+        
+        since_checkpoint = 0;
+        
+        if (stop_requested)
+        {
+            fprintf(stderr, "stopped; run again to resume from \"%s\".\n",
+                    checkpoint_path);
+            FreeVM(&vm);
+            return (EXIT_FAILURE);
+        }
+    }
+    
+    remove(checkpoint_path);
+    
+    if (hasFaulted(&vm))
+    {
+        PrintStatus(&vm);
+    }
+    
+    FreeVM(&vm);
+    return 0;
+}
+
 int main(int argc, const char * argv[]) {
-    if (argc != 2)
+    int engine = ENGINE_AUTO;
+    long n_threads = 0;
+    const char* inputs = NULL;
+    const char* records = NULL;
+    const char* checkpoint = NULL;
+    uint64_t checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+    
+    for (; argc > 2 && strncmp(argv[1], "--", 2) == 0; ++argv, --argc)
+    {
+        if (strncmp(argv[1], "--engine=", 9) == 0)
+        {
+            engine = parseEngine(argv[1] + 9);
+        }
+        else if (strncmp(argv[1], "--jobs=", 7) == 0)
+        {
+            n_threads = strtol(argv[1] + 7, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--inputs=", 9) == 0)
+        {
+            inputs = argv[1] + 9;
+        }
+        else if (strncmp(argv[1], "--records=", 10) == 0)
+        {
+            records = argv[1] + 10;
+        }
+        else if (strncmp(argv[1], "--record-size=", 14) == 0)
+        {
+            stream.record_size = strtoul(argv[1] + 14, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--checkpoint=", 13) == 0)
+        {
+            checkpoint = argv[1] + 13;
+        }
+        else if (strncmp(argv[1], "--checkpoint-interval=", 22) == 0)
+        {
+            checkpoint_interval = strtoull(argv[1] + 22, NULL, 10);
+        }
+        else if (strcmp(argv[1], "--unordered") == 0)
+        {
+            stream.unordered = true;
+        }
+        else if (strcmp(argv[1], "--lanes") == 0)
+        {
+            stream.lanes = true;
+        }
+        else if (strcmp(argv[1], "--collect=reg1") == 0)
+        {
+            stream.collect_reg1 = true;
+        }
+        else if (strcmp(argv[1], "--collect=output") == 0)
+        {
+            stream.collect_reg1 = false;
+        }
+        else
+        {
+            break;
+        }
+    }
+    
+    bool is_batch = n_threads != 0 || inputs != NULL || records != NULL
+                 || argc > 2;
+    
+    if (argc < 2 || engine < 0 || n_threads < 0
+        || (inputs != NULL && argc != 2)
+        || (records != NULL && (argc != 2 || inputs != NULL))
+        || (checkpoint != NULL && is_batch))
     {
-        puts("Usage: toy FILE.brick\n");
+        puts("Usage: toy [--engine=auto|interpreter|quick] FILE.brick\n"
+             "       toy [--engine=...] --checkpoint=FILE "
+             "[--checkpoint-interval=N] FILE.brick\n"
+             "       toy [--engine=...] [--jobs=N] FILE.brick...\n"
+             "       toy [--engine=...] [--jobs=N] --inputs=DIR FILE.brick\n"
+             "       toy [--engine=...] [--jobs=N] --records=FILE|- "
+             "[--record-size=BYTES] [--unordered] [--lanes] "
+             "[--collect=output|reg1] "
+             "FILE.brick\n");
         return 0;
     }
     
+    if (checkpoint != NULL)
+    {
+        return runCheckpointed(argv[1], checkpoint, engine,
+                               checkpoint_interval);
+    }
+    
+    if (is_batch)
+    {
+        batch.engine  = engine;
+        stream.engine = engine;
+        
+        if (n_threads == 0)
+        {
+            n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        
+        if (records != NULL)
+        {
+            return streamRecords(argv[1], records, n_threads);
+        }
+        
+        if (inputs != NULL)
+        {
+            size_t program_size;
+            uint8_t* program = readFile(argv[1], &program_size);
+            char** paths = listDirectory(inputs, &batch.n_jobs);
+            
+            if (program == NULL || paths == NULL)
+            {
+                printf("ERROR: cannot read \"%s\".\n",
+                       program == NULL ? argv[1] : inputs);
+                return (EXIT_FAILURE);
+            }
+            
+            if (!CreateVMImage(&batch.image, program, program_size))
+            {
+                puts("ERROR: out of memory.");
+                return (EXIT_FAILURE);
+            }
+            
+            free(program);
+            batch.has_image = true;
+            batch.jobs = calloc(batch.n_jobs, sizeof(job));
+            
+            for (size_t i = 0; i < batch.n_jobs; ++i)
+            {
+                batch.jobs[i].program_path = argv[1];
+                batch.jobs[i].input_path   = paths[i];
+            }
+            
+            free(paths);
+        }
+        else
+        {
+            batch.n_jobs = argc - 1;
+            batch.jobs = calloc(batch.n_jobs, sizeof(job));
+            
+            for (size_t i = 0; i < batch.n_jobs; ++i)
+            {
+                batch.jobs[i].program_path = argv[i + 1];
+            }
+        }
+        
+        int status = runBatch(n_threads);
+        
+        for (size_t i = 0; i < batch.n_jobs; ++i)
+        {
+            free((char*) batch.jobs[i].input_path);
+        }
+        
+        if (batch.has_image)
+        {
+            FreeVMImage(&batch.image);
+        }
+        
+        free(batch.jobs);
+        return status;
+    }
+    
     FILE* file = fopen(argv[1], "r");
     
     if (!file)
@@ -27,19 +1085,34 @@ int main(int argc, const char * argv[]) {
     
     size_t file_size = getFileSize(file);
     
+    if (!fitsInMemory(file_size))
+    {
+        fclose(file);
+        printf("ERROR: \"%s\" is too large.\n", argv[1]);
+        return (EXIT_FAILURE);
+    }
+    
     TOYVM vm;
-    InitializeVM(&vm, 2 * file_size, file_size);
     
-    fread(vm.memory, 1, file_size, file);
+    if (!InitializeVM(&vm, 2 * file_size, file_size))
+    {
+        fclose(file);
+        puts("ERROR: out of memory.");
+        return (EXIT_FAILURE);
+    }
+    
+    vm.engine = engine;
+    
+    uint8_t* program = (uint8_t*)malloc(file_size);
+    fread(program, 1, file_size, file);
     fclose(file);
+    
+    WriteVMMemory(&vm, program, file_size);
+    free(program);
 
     RunVM(&vm);
     
-    if (vm.cpu.status.BAD_ACCESS
-        || vm.cpu.status.BAD_INSTRUCTION
-        || vm.cpu.status.INVALID_REGISTER_INDEX
-        || vm.cpu.status.STACK_OVERFLOW
-        || vm.cpu.status.STACK_UNDERFLOW)
+    if (hasFaulted(&vm))
     {
         PrintStatus(&vm);
     }
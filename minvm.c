@@ -1,8 +1,78 @@
 #include "minvm.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(MINVM_MASKED_MEMORY_SIZE) && !defined(MINVM_MASKED_MEMORY)
+#define MINVM_MASKED_MEMORY
+#endif
+
+#if defined(MINVM_MASKED_MEMORY) + defined(MINVM_GUARD_PAGE) \
+    + defined(MINVM_PAGED_MEMORY) > 1
+#error "Choose at most one of MINVM_MASKED_MEMORY, MINVM_GUARD_PAGE and MINVM_PAGED_MEMORY"
+#endif
+
+#if defined(MINVM_MASKED_MEMORY_SIZE) \
+    && (MINVM_MASKED_MEMORY_SIZE & (MINVM_MASKED_MEMORY_SIZE - 1)) != 0
+#error "MINVM_MASKED_MEMORY_SIZE must be a power of two"
+#endif
+
+#ifdef MINVM_GUARD_PAGE
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*******************************************************************************
+* Guest words are little-endian. When the host is little-endian as well, a     *
+* word can be moved with a single (possibly unaligned) load or store.          *
+*******************************************************************************/
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MINVM_LITTLE_ENDIAN_HOST 1
+#else
+#define MINVM_LITTLE_ENDIAN_HOST 0
+#endif
+
+//vm_address 能表示的最大值，也就是内存大小的上限
+#define VM_ADDRESS_MAX ((vm_address) ((vm_unsigned_address) -1 >> 1))
+
+/*******************************************************************************
+* With -DMINVM_MASKED_MEMORY the memory size is a power of two and every guest *
+* address is ANDed with 'memory_size - 1' before use, so no guest access can   *
+* leave the machine's memory, without branches or large reservations.         *
+* Defining MINVM_MASKED_MEMORY_SIZE as well fixes the size at compile time,    *
+* which turns the mask into a constant.                                        *
+*******************************************************************************/
+#if defined(MINVM_MASKED_MEMORY_SIZE)
+#define MINVM_GUEST_ADDRESS(vm, address) \
+    ((address) & ((MINVM_MASKED_MEMORY_SIZE) - 1))
+#elif defined(MINVM_MASKED_MEMORY)
+#define MINVM_GUEST_ADDRESS(vm, address) \
+    ((address) & ((vm)->memory_size - 1))
+#else
+#define MINVM_GUEST_ADDRESS(vm, address) (address)
+#endif
+
+/*******************************************************************************
+* Marks the fault paths of the instruction handlers as cold, so the compiler   *
+* keeps the common path of each handler straight-line and moves the error     *
+* handling out of the way of the instruction cache and branch predictor.       *
+*******************************************************************************/
+#if defined(__GNUC__)
+#define MINVM_UNLIKELY(condition) __builtin_expect(!!(condition), 0)
+#else
+#define MINVM_UNLIKELY(condition) (condition)
+#endif
 
 /*
 opcode: 表示指令的操作码，是一个 8 位的无符号整数。
@@ -20,41 +90,32 @@ void Put(TOYVM vm, int idx) {
     printf("register value is the %d\n", vm.cpu.registers[idx]);
 }
 
-static bool StackIsEmpty(TOYVM* vm)
-{
-    return vm->cpu.stack_pointer >= vm->memory_size;
-}
-
-
-static bool StackIsFull(TOYVM* vm)
-{
-    return vm->cpu.stack_pointer <= vm->stack_limit;
-}
-
-
-static int32_t GetAvailableStackSize(TOYVM* vm)
-{
-    return vm->cpu.stack_pointer - vm->stack_limit;
-}
-
-
-static int32_t GetOccupiedStackSize(TOYVM* vm)
+/*******************************************************************************
+* 栈从 memory_size 向下增长到 stack_limit。所有压栈、出栈的指令都只通过下面三个 *
+* 函数检查栈的边界，每次检查只需一次比较。                                     *
+*******************************************************************************/
+//栈指针以下是否还有 size 个字节的栈空间。各种内存模式下都真正比较，保护页模式
+//下不写内存、不能靠保护页发现溢出的指令用它
+static bool StackFitsBelowPointer(TOYVM* vm, int32_t size)
 {
-    return vm->memory_size - vm->cpu.stack_pointer;
+    return vm->cpu.stack_pointer - vm->stack_limit >= size;
 }
 
-
-static bool CanPerformMultipush(TOYVM* vm)
+//栈上是否还能再压入 size 个字节
+static bool StackHasRoom(TOYVM* vm, int32_t size)
 {
-    return GetAvailableStackSize(vm) >= sizeof(int32_t) * N_REGISTERS;
+#ifdef MINVM_GUARD_PAGE
+    //栈下方是一个不可访问的保护页，溢出由硬件检测，见 RunVM
+    return true;
+#else
+    return StackFitsBelowPointer(vm, size);
+#endif
 }
 
-/*******************************************************************************
-* Returns 'true' if the stack can provide data for all registers.              *
-*******************************************************************************/
-static bool CanPerformMultipop(TOYVM* vm)
+//栈上是否至少有 size 个字节可以弹出
+static bool StackHasData(TOYVM* vm, int32_t size)
 {
-    return GetOccupiedStackSize(vm) >= sizeof(int32_t) * N_REGISTERS;
+    return vm->memory_size - vm->cpu.stack_pointer >= size;
 }
 
 /*******************************************************************************
@@ -67,891 +128,3833 @@ static bool InstructionFitsInMemory(TOYVM* vm, uint8_t opcode);
 *******************************************************************************/
 static size_t GetInstructionLength(TOYVM* vm, uint8_t opcode);
 
-void InitializeVM(TOYVM* vm, int32_t memory_size, int32_t stack_limit)
+/*******************************************************************************
+* Maps every undefined opcode in the instruction table to                      *
+* ExecuteBadInstruction. InitializeVM() runs it once, before any machine is    *
+* usable.                                                                      *
+*******************************************************************************/
+static void FillInstructionTable(void);
+
+/*******************************************************************************
+* quick_code 中每个字节的取值。QUICK_NONE 表示该地址还没有被加速（或已失效），  *
+* 其余取值对应 quick_instructions 中预先校验过的指令版本。                      *
+*******************************************************************************/
+enum {
+    QUICK_NONE = 0,
+    QUICK_GENERIC,
+    QUICK_ADD,
+    QUICK_NEG,
+    QUICK_MUL,
+    QUICK_CMP,
+    QUICK_JA,
+    QUICK_JE,
+    QUICK_JB,
+    QUICK_JMP,
+    QUICK_LOOP,
+    QUICK_LOAD,
+    QUICK_STORE,
+    QUICK_CONST,
+    QUICK_NOP,
+    
+    /* Superinstructions: two adjacent instructions fused into one dispatch. */
+    QUICK_CMP_JA,
+    QUICK_CMP_JE,
+    QUICK_CMP_JB,
+    QUICK_CONST_ADD,
+    
+    N_QUICK_OPCODES,
+    
+    /* The longest quickened sequence (CONST + ADD) is 9 bytes. */
+    MAX_QUICK_LENGTH = 9,
+};
+
+/*******************************************************************************
+* 内存 [address, address + size) 被改写后，所有覆盖到这段内存的指令（起始地址  *
+* 最多在 address 之前 MAX_QUICK_LENGTH - 1 个字节）都要重新校验，所以把它们在   *
+* quick_code 中的记录清零。                                                    *
+*******************************************************************************/
+static void InvalidateQuickCode(TOYVM* vm, vm_address address, int32_t size)
 {
-    /* Make sure both 'memory_size' and 'stack_limit' are divisible by 4. */
-    memory_size
-    += sizeof(int32_t) - (memory_size % sizeof(int32_t));
-    
-    stack_limit
-    += sizeof(int32_t) - (stack_limit % sizeof(int32_t));
-    
-    //分配内存空间并赋值0，每个元素大小都是uint8_t
-    uint8_t* memory = (uint8_t*)calloc(memory_size, sizeof(uint8_t));
-    vm->memory = memory;
-    vm->memory_size         = memory_size;
-    vm->stack_limit         = stack_limit;
-    vm->cpu.program_counter = 0;
-    vm->cpu.stack_pointer   = (int32_t) memory_size;
-    
-    /***************************************************************************
-    * Zero out all status flags.                                               *
-    ***************************************************************************/
-    vm->cpu.status.BAD_ACCESS       = 0;
-    vm->cpu.status.COMPARISON_ABOVE = 0;
-    vm->cpu.status.COMPARISON_EQUAL = 0;
-    vm->cpu.status.COMPARISON_BELOW = 0;
-    
-    vm->cpu.status.BAD_INSTRUCTION        = 0;
-    vm->cpu.status.INVALID_REGISTER_INDEX = 0;
-    vm->cpu.status.STACK_OVERFLOW         = 0;
-    vm->cpu.status.STACK_UNDERFLOW        = 0;
-    
-    //清空寄存器和操作码映射表
-    memset(vm->cpu.registers, 0, sizeof(int32_t) * N_REGISTERS);
-    memset(vm->opcode_map, 0, sizeof(vm->opcode_map));
-    
-    
-    //初始化操作码映射表，把指令映射到操作码
-    vm->opcode_map[ADD] = 1;
-    vm->opcode_map[NEG] = 2;
-    vm->opcode_map[MUL] = 3;
-    vm->opcode_map[DIV] = 4;
-    vm->opcode_map[MOD] = 5;
-    
-    vm->opcode_map[CMP] = 6;
-    vm->opcode_map[JA]  = 7;
-    vm->opcode_map[JE]  = 8;
-    vm->opcode_map[JB]  = 9;
-    vm->opcode_map[JMP] = 10;
-    
-    vm->opcode_map[CALL] = 11;
-    vm->opcode_map[RET]  = 12;
+    if (vm->quick_code == NULL)
+    {
+        return;
+    }
     
-    vm->opcode_map[LOAD]   = 13;
-    vm->opcode_map[STORE]  = 14;
-    vm->opcode_map[CONST]  = 15;
-    vm->opcode_map[RLOAD]  = 16;
-    vm->opcode_map[RSTORE] = 17;
+    vm_address begin = address - (MAX_QUICK_LENGTH - 1);
+    vm_address end   = address + size;
     
-    vm->opcode_map[HALT] = 18;
-    vm->opcode_map[INT]  = 19;
-    vm->opcode_map[NOP]  = 20;
+    if (begin < 0)
+    {
+        begin = 0;
+    }
     
-    vm->opcode_map[PUSH]     = 21;
-    vm->opcode_map[PUSH_ALL] = 22;
-    vm->opcode_map[POP]      = 23;
-    vm->opcode_map[POP_ALL]  = 24;
-    vm->opcode_map[LSP]      = 25;
+    if (end > vm->memory_size)
+    {
+        end = vm->memory_size;
+    }
     
+    if (begin < end)
+    {
+        memset(&vm->quick_code[begin], QUICK_NONE, end - begin);
+    }
 }
 
+/*******************************************************************************
+* 脏页位图：每 MINVM_DIRTY_PAGE_SIZE 字节一位，写入时置位。dirty_mark 记录位图  *
+* 上次清空时内存处于什么状态：DIRTY_MARK_ZERO 表示内存全零（InitializeVM 和     *
+* ResetVM 之后），DIRTY_MARK_NONE 表示不知道，其他值是某个快照或检查点文件的    *
+* 标记。内存与标记所指的状态只差位图中的页，ResetVM、RestoreVMSnapshot 和       *
+* CheckpointVM 在标记相符时只处理这些页。                                      *
+*******************************************************************************/
+#define DIRTY_MARK_NONE 0
+#define DIRTY_MARK_ZERO 1
 
-//把一段内存写（拷贝）到虚拟机中
-void WriteVMMemory(TOYVM* vm, uint8_t* mem, size_t size)
+static uint64_t GetDirtyPageCount(const TOYVM* vm)
 {
-    memcpy(mem, vm->memory, size);
+    return ((uint64_t) vm->memory_size + MINVM_DIRTY_PAGE_SIZE - 1)
+           / MINVM_DIRTY_PAGE_SIZE;
 }
 
+//第 page 页在内存中的字节数，只有最后一页可能不满
+static size_t GetDirtyPageSize(const TOYVM* vm, uint64_t page)
+{
+    uint64_t left = (uint64_t) vm->memory_size - page * MINVM_DIRTY_PAGE_SIZE;
+    return left < MINVM_DIRTY_PAGE_SIZE ? (size_t) left : MINVM_DIRTY_PAGE_SIZE;
+}
 
-/********************************
-这个函数用于从虚拟机内存的指定地址读取一个32位的有符号整数。
-函数首先从虚拟机内存中读取4个字节，然后按照小端序（Little 
-Endian）的方式将这4个字节组合成一个32位整数。
-*********************************/
-static int32_t ReadWord(TOYVM* vm, int32_t address)
+//一页是否全为零：第一个字节为零，并且每个字节都等于它后面的字节
+static bool IsZeroPage(const uint8_t* data, size_t size)
 {
-    uint8_t b1 = vm->memory[address];
-    uint8_t b2 = vm->memory[address + 1];
-    uint8_t b3 = vm->memory[address + 2];
-    uint8_t b4 = vm->memory[address + 3];
-    
-   
-    return (int32_t)((b4 << 24) | (b3 << 16) | (b2 << 8) | b1);
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
 }
 
+//位图的字节数，每个 uint64_t 存 64 页
+static size_t GetDirtyBitmapSize(const TOYVM* vm)
+{
+    return (size_t) ((GetDirtyPageCount(vm) + 63) / 64) * sizeof(uint64_t);
+}
 
-/*************************************************
- *这个函数用于将一个32位的有符号整数写入虚拟机内存的指定
- 地址。函数首先将整数值按照小端序拆分为4个字节，然后分别
- 写入虚拟机内存的指定地址和其后三个地址。
-*************************************************/
-void WriteWord(TOYVM* vm, int32_t address, int32_t value)
+//把 [address, address + size) 所在的页标记为脏页，超出内存的部分不记录
+static void MarkDirtyPages(TOYVM* vm, vm_unsigned_address address, size_t size)
 {
-    uint8_t b1 =  value & 0xff;
-    uint8_t b2 = (value & 0xff00) >> 8;
-    uint8_t b3 = (value & 0xff0000) >> 16;
-    uint8_t b4 = (value & 0xff000000) >> 24;
+    uint64_t page  = (uint64_t) address / MINVM_DIRTY_PAGE_SIZE;
+    uint64_t last  = ((uint64_t) address + size - 1) / MINVM_DIRTY_PAGE_SIZE;
+    uint64_t count = GetDirtyPageCount(vm);
     
-    vm->memory[address]     = b1;
-    vm->memory[address + 1] = b2;
-    vm->memory[address + 2] = b3;
-    vm->memory[address + 3] = b4;
+    //跨页、越界和空的写入很少见，常见的一个字的写入只需置一位
+    if (MINVM_UNLIKELY(size == 0 || page != last || last >= count))
+    {
+        if (size == 0 || page >= count)
+        {
+            return;
+        }
+        
+        last = last < count ? last : count - 1;
+        
+        for (; page < last; ++page)
+        {
+            vm->dirty_pages[page / 64] |= UINT64_C(1) << (page % 64);
+        }
+    }
+    
+    vm->dirty_pages[page / 64] |= UINT64_C(1) << (page % 64);
 }
 
-
-//这个函数用于从虚拟机内存的指定地址读取一个8位的无符号整数（字节）。
-static uint8_t ReadByte(TOYVM* vm, size_t address)
+//清空位图，并记下此时内存的状态
+static void ResetDirtyPages(TOYVM* vm, uint64_t mark)
 {
-    return vm->memory[address];
+    memset(vm->dirty_pages, 0, GetDirtyBitmapSize(vm));
+    vm->dirty_mark = mark;
 }
 
 /*******************************************************************************
-这个函数用于从虚拟机的栈中弹出一个32位的有符号整数（一个字）。首先，函数检查栈是否为空（
-使用StackIsEmpty函数）。如果栈为空，则设置BAD_ACCESS标志位为1，表示发生了内存访问错误
-并返回0。否则，从栈顶读取一个32位整数，并将栈指针增加4个字节，指向下一个位置，然后返回读
-取的整数值。                                                         *
+* 生成一个新的标记。检查点文件中也保存标记，别的进程会读到它，所以计数器再混入  *
+* 时间和计数器自己的地址，使不同进程生成的标记也几乎不会相同。                  *
 *******************************************************************************/
-static int32_t PopVM(TOYVM* vm)
+static uint64_t NewDirtyMark(void)
 {
-    if (StackIsEmpty(vm))
-    {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return 0;
-    }
+    static atomic_uint_fast64_t counter;
+    uint64_t mark = (uint64_t) atomic_fetch_add(&counter, 1)
+                  ^ ((uint64_t) time(NULL) << 24)
+                  ^ (uint64_t) (uintptr_t) &counter;
     
-    int32_t word = ReadWord(vm, vm->cpu.stack_pointer);
-    vm->cpu.stack_pointer += 4;
-    return word;
+    //splitmix64 的混合函数
+    mark = (mark ^ (mark >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    mark = (mark ^ (mark >> 27)) * UINT64_C(0x94d049bb133111eb);
+    mark =  mark ^ (mark >> 31);
+    
+    return mark > DIRTY_MARK_ZERO ? mark : mark + DIRTY_MARK_ZERO + 1;
 }
 
-/*******************************************************************************
-这个函数用于将一个32位的无符号整数（一个字）压入虚拟机的栈中。函数首先使用WriteWord函数
-将整数值写入栈顶位置，然后将栈指针减少4个字节，指向下一个空闲位置                                            *
-*******************************************************************************/
-static void PushVM(TOYVM* vm, uint32_t value)
+bool IsVMPageDirty(const TOYVM* vm, uint64_t page)
 {
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, value);
+    return page < GetDirtyPageCount(vm)
+        && (vm->dirty_pages[page / 64] >> (page % 64) & 1) != 0;
 }
-/******************************************************************************
- * 这个函数用于检查给定的字节值（操作码中的寄存器索引）是否有效。TOYVM虚拟机有4个寄存器
- * （REG1、REG2、REG3、REG4），这个函数检查给定的字节值是否与其中一个寄存器的索引相匹配。
- * 如果是有效的寄存器索引，返回true，否则返回false。
-******************************************************************************/
-static bool IsValidRegisterIndex(uint8_t byte)
+
+uint64_t NextDirtyVMPage(const TOYVM* vm, uint64_t page)
 {
-    switch (byte)
+    while (page < GetDirtyPageCount(vm))
     {
-        case REG1:
-        case REG2:
-        case REG3:
-        case REG4:
-            return true;
+        uint64_t bits = vm->dirty_pages[page / 64] >> (page % 64);
+        
+        if (bits == 0)
+        {
+            //这个字中剩下的页都是干净的，直接跳到下一个字
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        
+        for (; (bits & 1) == 0; bits >>= 1)
+        {
+            ++page;
+        }
+        
+        return page;
     }
     
-    return false;
+    return UINT64_MAX;
+}
+
+void ClearVMDirtyPages(TOYVM* vm)
+{
+    ResetDirtyPages(vm, DIRTY_MARK_NONE);
 }
 
+#ifdef MINVM_GUARD_PAGE
+static int64_t RoundUpToPage(int64_t size, int64_t page_size)
+{
+    return (size + page_size - 1) / page_size * page_size;
+}
 
-//这个函数用于获取虚拟机当前的程序计数器值（program_counter），即下一条待执行指令的地址。
-static int32_t GetProgramCounter(TOYVM* vm)
+//保护页位于栈的正下方，占一页
+static int32_t GetGuardPage(TOYVM* vm)
 {
-    return vm->cpu.program_counter;
+    return vm->stack_limit - (int32_t) sysconf(_SC_PAGESIZE);
 }
+#endif
 
-//用于执行ADD指令
-static bool ExecuteAdd(TOYVM* vm)
+#if defined(MINVM_MASKED_MEMORY) && !defined(MINVM_MASKED_MEMORY_SIZE)
+//不小于 size 的最小的 2 的幂，至少为 4
+static int64_t RoundUpToPowerOfTwo(int64_t size)
 {
-    uint8_t source_register_index;//源寄存器索引
-    uint8_t target_register_index;//目标寄存器索引
+    int64_t power = sizeof(int32_t);
     
-    if (!InstructionFitsInMemory(vm, ADD))
+    while (power < size)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        power <<= 1;
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
-    
-/*
- 检查读取的源寄存器索引和目标寄存器索引是否有效。如果任何一个索引无效，即不是合法的寄存器索引，
- 将INVALID_REGISTER_INDEX标志位设置为1，并返回true，表示执行失败。
-*/
+    return power;
+}
+#endif
 
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
-    {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
-    }
+//程序计数器、栈指针、状态标志位和寄存器回到初始状态
+static void ResetCPU(TOYVM* vm)
+{
+    vm->cpu.program_counter = 0;
+    vm->cpu.stack_pointer   = vm->memory_size;
     
-    vm->cpu.registers[target_register_index]
-    += vm->cpu.registers[source_register_index];
+    /***************************************************************************
+    * Zero out all status flags.                                               *
+    ***************************************************************************/
+    vm->cpu.status.BAD_ACCESS       = 0;
+    vm->cpu.status.COMPARISON_ABOVE = 0;
+    vm->cpu.status.COMPARISON_EQUAL = 0;
+    vm->cpu.status.COMPARISON_BELOW = 0;
     
-    //将程序计数器（program_counter）前进到下一条指令的地址，跳过当前ADD指令。
-    vm->cpu.program_counter += GetInstructionLength(vm, ADD);
-    return false;
+    vm->cpu.status.BAD_INSTRUCTION        = 0;
+    vm->cpu.status.INVALID_REGISTER_INDEX = 0;
+    vm->cpu.status.STACK_OVERFLOW         = 0;
+    vm->cpu.status.STACK_UNDERFLOW        = 0;
+    
+    //清空寄存器
+    memset(vm->cpu.registers, 0, sizeof(int32_t) * N_REGISTERS);
 }
 
-
-//跟上一个指令大同小异，作用是取反
-static bool ExecuteNeg(TOYVM* vm)
+/*******************************************************************************
+* 按已经调整好的 memory_size 和 stack_limit 分配内存并初始化虚拟机的其他字段。 *
+* InitializeVM 先按内存模式调整大小再调用这里，RestoreVM 直接用检查点中记录的、 *
+* 已经调整过的大小调用这里。分配失败时返回 false，虚拟机被清零。               *
+*******************************************************************************/
+static bool AllocateVM(TOYVM* vm, vm_address memory_size,
+                       vm_address stack_limit)
 {
-    if (!InstructionFitsInMemory(vm, NEG))//检查当前指令是否能正常执行
+#ifdef MINVM_GUARD_PAGE
+    int32_t page_size  = (int32_t) sysconf(_SC_PAGESIZE);
+    int32_t guard_page = stack_limit - page_size;
+    
+    uint8_t* memory = mmap(NULL,
+                           memory_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+    
+    if (memory == MAP_FAILED)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        memory = NULL;
     }
-    
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);//读取寄存器索引
-    
-    if (!IsValidRegisterIndex(register_index))
+    else
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        mprotect(memory + guard_page, page_size, PROT_NONE);
     }
+#elif defined(MINVM_PAGED_MEMORY)
+    //只分配页表，页在第一次访问时分配
+    uint8_t* memory = NULL;
+    size_t page_count = ((vm_unsigned_address) memory_size
+                         + MINVM_PAGE_SIZE - 1) >> MINVM_PAGE_SHIFT;
     
-    vm->cpu.registers[register_index] = -vm->cpu.registers[register_index];
-    vm->cpu.program_counter += GetInstructionLength(vm, NEG);//跳过当前执行完的指令
-    return false;
-}
-
-
-//将两个寄存器的值相乘，结果存到目标寄存器步骤大同小异
-static bool ExecuteMul(TOYVM* vm)
-{
-    uint8_t source_register_index;
-    uint8_t target_register_index;
+    vm->pages     = (uint8_t**)calloc(page_count, sizeof(uint8_t*));
+    vm->void_page = (uint8_t*)calloc(MINVM_PAGE_SIZE, sizeof(uint8_t));
     
-    if (!InstructionFitsInMemory(vm, MUL))
+    for (size_t i = 0; i < MINVM_TLB_SIZE; ++i)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        vm->tlb[i].page = (vm_unsigned_address) -1;
+        vm->tlb[i].data = NULL;
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    vm->out_of_memory = false;
     
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
+    bool allocated = vm->pages != NULL && vm->void_page != NULL;
+#else
+    //分配内存空间并赋值0，每个元素大小都是uint8_t
+    uint8_t* memory = (uint8_t*)calloc(memory_size, sizeof(uint8_t));
+#endif
+#ifndef MINVM_PAGED_MEMORY
+    bool allocated = memory != NULL;
+#endif
+    vm->memory = memory;
+    //加速表在 RunVM 切换到加速解释器时才分配
+    vm->quick_code = NULL;
+    vm->engine     = ENGINE_AUTO;
+#ifdef MINVM_PROFILE
+    vm->opcode_pair_counts = (uint64_t*)calloc(OPCODE_MAP_SIZE * OPCODE_MAP_SIZE,
+                                               sizeof(uint64_t));
+    vm->previous_opcode = 0;
+#endif
+#ifdef MINVM_COVERAGE
+    vm->coverage_map = NULL;
+#endif
+    vm->memory_size = memory_size;
+    vm->stack_limit = stack_limit;
+    vm->output      = stdout;
+    vm->fuel        = UINT64_MAX;
+    vm->dirty_pages = (uint64_t*)calloc(GetDirtyBitmapSize(vm), sizeof(uint8_t));
+    vm->dirty_mark  = DIRTY_MARK_ZERO;
+    ResetCPU(vm);
+    
+    allocated = allocated && vm->dirty_pages != NULL;
+#ifdef MINVM_PROFILE
+    allocated = allocated && vm->opcode_pair_counts != NULL;
+#endif
+    
+    //分配失败时释放已经分配的部分，清零后的虚拟机可以再交给 FreeVM
+    if (!allocated)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        FreeVM(vm);
+        memset(vm, 0, sizeof(TOYVM));
     }
     
-    vm->cpu.registers[target_register_index] *=
-    vm->cpu.registers[source_register_index];
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, MUL);
-    return false;
+    return allocated;
 }
 
-
-//两数相除
-static bool ExecuteDiv(TOYVM* vm)
+bool InitializeVM(TOYVM* vm, vm_address memory_size, vm_address stack_limit)
 {
-    uint8_t source_register_index;
-    uint8_t target_register_index;
+    static pthread_once_t instruction_table_once = PTHREAD_ONCE_INIT;
+    
+    pthread_once(&instruction_table_once, FillInstructionTable);
     
-    if (!InstructionFitsInMemory(vm, DIV))
+    //调整之后的大小必须仍在 vm_address 的范围之内，下面用 64 位计算
+    if (memory_size < 0 || memory_size > VM_ADDRESS_MAX - 4
+        || stack_limit < 0 || stack_limit > VM_ADDRESS_MAX - 4)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        memset(vm, 0, sizeof(TOYVM));
+        return false;
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    int64_t size  = memory_size;
+    int64_t limit = stack_limit;
+    
+#if defined(MINVM_MASKED_MEMORY_SIZE)
+    size = MINVM_MASKED_MEMORY_SIZE;
+#elif defined(MINVM_MASKED_MEMORY)
+    size = RoundUpToPowerOfTwo(size);
+#else
+    /* Make sure both 'memory_size' and 'stack_limit' are divisible by 4. */
+    size += sizeof(int32_t) - (size % sizeof(int32_t));
+#endif
+    
+    limit += sizeof(int32_t) - (limit % sizeof(int32_t));
+    
+#ifdef MINVM_GUARD_PAGE
+    /***************************************************************************
+    * 把栈对齐到页边界，并在栈的下方留出一个不可访问的保护页：                   *
+    * [0, guard_page) 为原来的程序和数据区，[guard_page, stack_limit) 为保护页，  *
+    * [stack_limit, memory_size) 为栈，栈的大小不小于原来的大小。               *
+    ***************************************************************************/
+    int64_t page_size  = sysconf(_SC_PAGESIZE);
+    int64_t stack_size = size - limit;
+    int64_t guard_page = RoundUpToPage(limit, page_size);
     
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
+    limit = guard_page + page_size;
+    size  = limit + RoundUpToPage(stack_size, page_size);
+#endif
+    
+    if (size > VM_ADDRESS_MAX)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        memset(vm, 0, sizeof(TOYVM));
+        return false;
     }
     
-    vm->cpu.registers[target_register_index] /=
-    vm->cpu.registers[source_register_index];
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, DIV);
-    return false;
+    return AllocateVM(vm, (vm_address) size, (vm_address) limit);
 }
 
-//取模指令
-static bool ExecuteMod(TOYVM* vm)
+//把第 page 页的内存和加速表清零；分页内存直接释放这一页，下次访问时重新分配
+static void ClearPage(TOYVM* vm, uint64_t page)
 {
-    uint8_t source_register_index;
-    uint8_t target_register_index;
+    size_t offset = (size_t) page * MINVM_DIRTY_PAGE_SIZE;
+    size_t size   = GetDirtyPageSize(vm, page);
+    
+#ifdef MINVM_PAGED_MEMORY
+    free(vm->pages[page]);
+    vm->pages[page] = NULL;
+#else
+    //已经是零的页不再写，ReleaseVMMemory 交还的页就不会因此重新分配
+    if (!IsZeroPage(vm->memory + offset, size))
+    {
+        memset(vm->memory + offset, 0, size);
+    }
+#endif
     
-    if (!InstructionFitsInMemory(vm, MOD))
+    if (vm->quick_code != NULL && !IsZeroPage(vm->quick_code + offset, size))
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
-    }
-    
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
-    
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
-    {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        memset(vm->quick_code + offset, QUICK_NONE, size);
     }
-    
-    vm->cpu.registers[target_register_index] =
-    vm->cpu.registers[source_register_index] %
-    vm->cpu.registers[target_register_index];
-    
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, MOD);
-    return false;
 }
 
-
-//比较指令
-
-static bool ExecuteCmp(TOYVM* vm)
+void ResetVM(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, CMP))
+    if (vm->dirty_mark == DIRTY_MARK_ZERO)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        //上次清空位图时内存就是全零的，只需要清零之后写过的页
+        for (uint64_t page = NextDirtyVMPage(vm, 0);
+             page != UINT64_MAX;
+             page = NextDirtyVMPage(vm, page + 1))
+        {
+            ClearPage(vm, page);
+        }
     }
-    
-    uint8_t register_index_1 = ReadByte(vm, GetProgramCounter(vm) + 1);
-    uint8_t register_index_2 = ReadByte(vm, GetProgramCounter(vm) + 2);
-    
-    if (!IsValidRegisterIndex(register_index_1) ||
-        !IsValidRegisterIndex(register_index_2))
+    else
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+#if defined(MINVM_GUARD_PAGE)
+        //保护页不可写，跳过它
+        memset(vm->memory, 0, GetGuardPage(vm));
+        memset(vm->memory + vm->stack_limit, 0,
+               vm->memory_size - vm->stack_limit);
+#elif defined(MINVM_PAGED_MEMORY)
+        //释放所有的页，下次访问时重新分配为全零的页
+        for (uint64_t page = 0; page < GetDirtyPageCount(vm); ++page)
+        {
+            free(vm->pages[page]);
+            vm->pages[page] = NULL;
+        }
+#else
+        memset(vm->memory, 0, vm->memory_size);
+#endif
+        //加速表保留下来，复用的虚拟机不必再预热
+        if (vm->quick_code != NULL)
+        {
+            memset(vm->quick_code, QUICK_NONE, vm->memory_size);
+        }
     }
     
-    int32_t register_1 = vm->cpu.registers[register_index_1];
-    int32_t register_2 = vm->cpu.registers[register_index_2];
-    
-    if (register_1 < register_2)
+#ifdef MINVM_PAGED_MEMORY
+    for (size_t i = 0; i < MINVM_TLB_SIZE; ++i)
     {
-        vm->cpu.status.COMPARISON_ABOVE = 0;
-        vm->cpu.status.COMPARISON_EQUAL = 0;
-        vm->cpu.status.COMPARISON_BELOW = 1;
+        vm->tlb[i].page = (vm_unsigned_address) -1;
+        vm->tlb[i].data = NULL;
     }
-    else if (register_1 > register_2)
+    
+    //没能分配的页现在和其他没有分配的页一样是全零的
+    vm->out_of_memory = false;
+#endif
+    ResetDirtyPages(vm, DIRTY_MARK_ZERO);
+    vm->fuel = UINT64_MAX;
+    ResetCPU(vm);
+}
+
+void FreeVM(TOYVM* vm)
+{
+#if defined(MINVM_GUARD_PAGE)
+    if (vm->memory != NULL)
     {
-        vm->cpu.status.COMPARISON_ABOVE = 1;
-        vm->cpu.status.COMPARISON_EQUAL = 0;
-        vm->cpu.status.COMPARISON_BELOW = 0;
+        munmap(vm->memory, vm->memory_size);
     }
-    else
+#elif defined(MINVM_PAGED_MEMORY)
+    size_t page_count = ((vm_unsigned_address) vm->memory_size
+                         + MINVM_PAGE_SIZE - 1) >> MINVM_PAGE_SHIFT;
+    
+    for (size_t i = 0; vm->pages != NULL && i < page_count; ++i)
     {
-        vm->cpu.status.COMPARISON_ABOVE = 0;
-        vm->cpu.status.COMPARISON_EQUAL = 1;
-        vm->cpu.status.COMPARISON_BELOW = 0;
+        free(vm->pages[i]);
     }
     
-    vm->cpu.program_counter += GetInstructionLength(vm, CMP);
-    return false;
+    free(vm->pages);
+    free(vm->void_page);
+    vm->pages     = NULL;
+    vm->void_page = NULL;
+#else
+    free(vm->memory);
+#endif
+    free(vm->quick_code);
+    free(vm->dirty_pages);
+    vm->dirty_pages = NULL;
+#ifdef MINVM_PROFILE
+    free(vm->opcode_pair_counts);
+    vm->opcode_pair_counts = NULL;
+#endif
+    vm->memory     = NULL;
+    vm->quick_code = NULL;
 }
 
 
-static bool ExecuteJumpIfAbove(TOYVM* vm)
+#ifdef MINVM_PAGED_MEMORY
+/*******************************************************************************
+* 分页内存：内存按 MINVM_PAGE_SIZE 分页，页在第一次被访问时才分配。每台虚拟机有 *
+* 一个直接映射的小 TLB，缓存最近翻译过的页，命中时只需一次比较。超出           *
+* memory_size 的地址落到 void_page 上，不会越界。页分配失败时返回 NULL 并设置  *
+* out_of_memory，由 RunVM 报告 BAD_ACCESS。                                    *
+*******************************************************************************/
+static uint8_t* TranslatePage(TOYVM* vm, vm_unsigned_address page)
 {
-    if (!InstructionFitsInMemory(vm, JA))
-    {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
-    }
+    vm_unsigned_address page_count =
+        ((vm_unsigned_address) vm->memory_size + MINVM_PAGE_SIZE - 1)
+        >> MINVM_PAGE_SHIFT;
     
-    if (vm->cpu.status.COMPARISON_ABOVE)
+    if (page >= page_count)
     {
-        //跳转到下个内存位置所存地址
-        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+        return vm->void_page;
     }
-    else
+    
+    if (vm->pages[page] == NULL)
     {
-        vm->cpu.program_counter += GetInstructionLength(vm, JA);
+        vm->pages[page] = (uint8_t*)calloc(MINVM_PAGE_SIZE, sizeof(uint8_t));
+        
+        if (vm->pages[page] == NULL)
+        {
+            vm->out_of_memory = true;
+            return NULL;
+        }
     }
     
-    return false;
+    return vm->pages[page];
 }
 
-static bool ExecuteJumpIfEqual(TOYVM* vm)
+//返回客户机地址 address 对应的宿主机地址
+static uint8_t* GuestMemory(TOYVM* vm, vm_unsigned_address address)
 {
-    if (!InstructionFitsInMemory(vm, JE))
+    vm_unsigned_address page = address >> MINVM_PAGE_SHIFT;
+    VM_TLB_ENTRY* entry = &vm->tlb[page % MINVM_TLB_SIZE];
+    
+    if (MINVM_UNLIKELY(entry->page != page))
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        uint8_t* data = TranslatePage(vm, page);
+        
+        //这次访问落到 void_page 上，但不把它放进 TLB，下次访问时再分配这一页
+        if (data == NULL)
+        {
+            return vm->void_page + (address & (MINVM_PAGE_SIZE - 1));
+        }
+        
+        entry->page = page;
+        entry->data = data;
     }
     
-    if (vm->cpu.status.COMPARISON_EQUAL)
+    return entry->data + (address & (MINVM_PAGE_SIZE - 1));
+}
+
+//一个字是否完整地位于一页之内
+static bool WordFitsInPage(vm_unsigned_address address)
+{
+    return (address & (MINVM_PAGE_SIZE - 1))
+           <= MINVM_PAGE_SIZE - sizeof(int32_t);
+}
+
+//从 address 开始的字所在的页是否都已经分配，访问它时不必再分配页；超出
+//memory_size 的页落到 void_page 上，也不必分配
+static bool WordIsMapped(TOYVM* vm, vm_unsigned_address address)
+{
+    vm_unsigned_address page_count =
+        ((vm_unsigned_address) vm->memory_size + MINVM_PAGE_SIZE - 1)
+        >> MINVM_PAGE_SHIFT;
+    vm_unsigned_address first = address >> MINVM_PAGE_SHIFT;
+    vm_unsigned_address last  = (address + sizeof(int32_t) - 1)
+                                >> MINVM_PAGE_SHIFT;
+    
+    return (first >= page_count || vm->pages[first] != NULL)
+        && (last  >= page_count || vm->pages[last]  != NULL);
+}
+#else
+//返回客户机地址 address 对应的宿主机地址
+static uint8_t* GuestMemory(TOYVM* vm, vm_unsigned_address address)
+{
+    return &vm->memory[address];
+}
+#endif
+
+#ifdef MINVM_MASKED_MEMORY
+//从屏蔽过的地址 address 开始的字是否完整地位于内存之内
+static bool WordFitsInMemory(TOYVM* vm, vm_unsigned_address address)
+{
+    return address <= (vm_unsigned_address) vm->memory_size - sizeof(int32_t);
+}
+#endif
+
+
+//这个函数用于从虚拟机内存的指定地址读取一个8位的无符号整数（字节）。
+static uint8_t ReadByte(TOYVM* vm, size_t address)
+{
+    return *GuestMemory(vm, MINVM_GUEST_ADDRESS(vm, address));
+}
+
+
+//把一段内存写（拷贝）到虚拟机中
+void WriteVMMemory(TOYVM* vm, uint8_t* mem, size_t size)
+{
+    WriteVMMemoryAt(vm, 0, mem, size);
+}
+
+void WriteVMMemoryAt(TOYVM* vm, vm_address address, const uint8_t* mem,
+                     size_t size)
+{
+#ifdef MINVM_PAGED_MEMORY
+    //逐页拷贝
+    for (size_t offset = 0; offset < size;)
     {
-        //跳转到下个内存位置所存地址
-        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+        vm_unsigned_address target = address + offset;
+        size_t chunk = MINVM_PAGE_SIZE - (target & (MINVM_PAGE_SIZE - 1));
+        
+        if (chunk > size - offset)
+        {
+            chunk = size - offset;
+        }
+        
+        memcpy(GuestMemory(vm, target), mem + offset, chunk);
+        offset += chunk;
     }
-    else
+#else
+    memcpy(vm->memory + address, mem, size);
+#endif
+    InvalidateQuickCode(vm, address, (int32_t) size);
+    MarkDirtyPages(vm, address, size);
+}
+
+
+/********************************
+这个函数用于从虚拟机内存的指定地址读取一个32位的有符号整数。
+函数首先从虚拟机内存中读取4个字节，然后按照小端序（Little 
+Endian）的方式将这4个字节组合成一个32位整数。
+*********************************/
+static int32_t ReadWord(TOYVM* vm, vm_address address)
+{
+    address = MINVM_GUEST_ADDRESS(vm, address);
+    
+#if defined(MINVM_PAGED_MEMORY) || defined(MINVM_MASKED_MEMORY)
+    //跨页的字逐个字节读取；屏蔽内存模式下跨过内存末尾的字节折回内存开头
+#ifdef MINVM_PAGED_MEMORY
+    if (MINVM_UNLIKELY(!WordFitsInPage(address)))
+#else
+    if (MINVM_UNLIKELY(!WordFitsInMemory(vm, address)))
+#endif
     {
-        vm->cpu.program_counter += GetInstructionLength(vm, JE);
+        return (int32_t)(((uint32_t) ReadByte(vm, address + 3) << 24)
+                       | ((uint32_t) ReadByte(vm, address + 2) << 16)
+                       | ((uint32_t) ReadByte(vm, address + 1) << 8)
+                       |  (uint32_t) ReadByte(vm, address));
     }
+#endif
     
-    return false;
+    const uint8_t* bytes = GuestMemory(vm, address);
+    
+#if MINVM_LITTLE_ENDIAN_HOST
+    //宿主机本身是小端序时，直接一次读出整个字
+    int32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+#else
+    uint8_t b1 = bytes[0];
+    uint8_t b2 = bytes[1];
+    uint8_t b3 = bytes[2];
+    uint8_t b4 = bytes[3];
+    
+   
+    return (int32_t)((b4 << 24) | (b3 << 16) | (b2 << 8) | b1);
+#endif
 }
 
-static bool ExecuteJumpIfBelow(TOYVM* vm)
+
+/*************************************************
+ *这个函数用于将一个32位的有符号整数写入虚拟机内存的指定
+ 地址。函数首先将整数值按照小端序拆分为4个字节，然后分别
+ 写入虚拟机内存的指定地址和其后三个地址。
+*************************************************/
+void WriteWord(TOYVM* vm, vm_address address, int32_t value)
 {
-    if (!InstructionFitsInMemory(vm, JB))
-    {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
-    }
+    address = MINVM_GUEST_ADDRESS(vm, address);
     
-    if (vm->cpu.status.COMPARISON_BELOW)
+#ifdef MINVM_PAGED_MEMORY
+    //跨页的字逐个字节写入
+    if (MINVM_UNLIKELY(!WordFitsInPage(address)))
     {
-        //跳转到下个内存位置所存地址
-        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+        for (int i = 0; i < (int) sizeof(value); ++i)
+        {
+            *GuestMemory(vm, address + i) = (uint8_t)((uint32_t) value >> (8 * i));
+        }
+        
+        InvalidateQuickCode(vm, address, sizeof(value));
+        MarkDirtyPages(vm, address, sizeof(value));
+        return;
     }
-    else
+#elif defined(MINVM_MASKED_MEMORY)
+    //跨过内存末尾的字逐个字节写入，越过末尾的字节折回内存开头
+    if (MINVM_UNLIKELY(!WordFitsInMemory(vm, address)))
     {
-        vm->cpu.program_counter += GetInstructionLength(vm, JB);
+        for (int i = 0; i < (int) sizeof(value); ++i)
+        {
+            vm_address byte_address = MINVM_GUEST_ADDRESS(vm, address + i);
+            
+            vm->memory[byte_address] = (uint8_t)((uint32_t) value >> (8 * i));
+            InvalidateQuickCode(vm, byte_address, 1);
+            MarkDirtyPages(vm, byte_address, 1);
+        }
+        
+        return;
     }
+#endif
     
-    return false;
+    uint8_t* bytes = GuestMemory(vm, address);
+    
+#if MINVM_LITTLE_ENDIAN_HOST
+    memcpy(bytes, &value, sizeof(value));
+    InvalidateQuickCode(vm, address, sizeof(value));
+    MarkDirtyPages(vm, address, sizeof(value));
+#else
+    uint8_t b1 =  value & 0xff;
+    uint8_t b2 = (value & 0xff00) >> 8;
+    uint8_t b3 = (value & 0xff0000) >> 16;
+    uint8_t b4 = (value & 0xff000000) >> 24;
+    
+    bytes[0] = b1;
+    bytes[1] = b2;
+    bytes[2] = b3;
+    bytes[3] = b4;
+    InvalidateQuickCode(vm, address, sizeof(value));
+    MarkDirtyPages(vm, address, sizeof(value));
+#endif
 }
 
-static bool ExecuteJump(TOYVM* vm)
+/*******************************************************************************
+这个函数用于从虚拟机的栈中弹出一个32位的有符号整数（一个字）。从栈顶读取一个32位整数，并将
+栈指针增加4个字节，指向下一个位置，然后返回读取的整数值。调用者需要先用StackHasData检查栈
+中有数据。                                                                   *
+*******************************************************************************/
+static int32_t PopVM(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, JMP))
-    {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
-    }
-    
-    //跳转指令
-    vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
-    return false;
+    int32_t word = ReadWord(vm, vm->cpu.stack_pointer);
+    vm->cpu.stack_pointer += 4;
+    return word;
 }
 
-static bool ExecuteCall(TOYVM* vm)
+/*******************************************************************************
+这个函数用于将一个32位的无符号整数（一个字）压入虚拟机的栈中。函数首先使用WriteWord函数
+将整数值写入栈顶位置，然后将栈指针减少4个字节，指向下一个空闲位置。调用者需要先用
+StackHasRoom检查栈上有空间。                                                  *
+*******************************************************************************/
+static void PushVM(TOYVM* vm, uint32_t value)
 {
-    if (!InstructionFitsInMemory(vm, CALL))
-    {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
-    }
-    
-    if (GetAvailableStackSize(vm) < 4)
+    //先写入再移动栈指针，写入保护页出错时栈指针保持不变
+    WriteWord(vm, vm->cpu.stack_pointer - 4, value);
+    vm->cpu.stack_pointer -= 4;
+}
+/******************************************************************************
+ * 这个函数用于检查给定的字节值（操作码中的寄存器索引）是否有效。TOYVM虚拟机有4个寄存器
+ * （REG1、REG2、REG3、REG4），这个函数检查给定的字节值是否与其中一个寄存器的索引相匹配。
+ * 如果是有效的寄存器索引，返回true，否则返回false。
+******************************************************************************/
+static bool IsValidRegisterIndex(uint8_t byte)
+{
+    switch (byte)
     {
-        vm->cpu.status.STACK_OVERFLOW = 1;
-        return true;
+        case REG1:
+        case REG2:
+        case REG3:
+        case REG4:
+            return true;
     }
     
-    //读取需要调用的函数起始地址,保存当前执行位置到堆栈
-    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 1);
-    PushVM(vm, (uint32_t)(GetProgramCounter(vm) +
-                          GetInstructionLength(vm, CALL)));
-    //跳转
-    vm->cpu.program_counter = address;
     return false;
 }
 
 
-//函数执行结束，返回调用函数的地方
-static bool ExecuteRet(TOYVM* vm)
+//这个函数用于获取虚拟机当前的程序计数器值（program_counter），即下一条待执行指令的地址。
+static vm_address GetProgramCounter(TOYVM* vm)
+{
+    return vm->cpu.program_counter;
+}
+
+//用于执行ADD指令
+static bool ExecuteAdd(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, RET))
+    uint8_t source_register_index;//源寄存器索引
+    uint8_t target_register_index;//目标寄存器索引
+    
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, ADD)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (StackIsEmpty(vm))
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+/*
+ 检查读取的源寄存器索引和目标寄存器索引是否有效。如果任何一个索引无效，即不是合法的寄存器索引，
+ 将INVALID_REGISTER_INDEX标志位设置为1，并返回true，表示执行失败。
+*/
+
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(source_register_index) ||
+                       !IsValidRegisterIndex(target_register_index)))
     {
-        vm->cpu.status.STACK_UNDERFLOW = 1;
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    vm->cpu.program_counter = PopVM(vm);
+    vm->cpu.registers[target_register_index]
+    += vm->cpu.registers[source_register_index];
+    
+    //将程序计数器（program_counter）前进到下一条指令的地址，跳过当前ADD指令。
+    vm->cpu.program_counter += GetInstructionLength(vm, ADD);
     return false;
 }
 
 
-//把内存中的数据读到指定寄存器
-static bool ExecuteLoad(TOYVM* vm)
+//跟上一个指令大同小异，作用是取反
+static bool ExecuteNeg(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, LOAD))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, NEG)))//检查当前指令是否能正常执行
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    //读取寄存器索引
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);//读取寄存器索引
     
-    if (!IsValidRegisterIndex(register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-
-
-    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
-    vm->cpu.registers[register_index] = ReadWord(vm, address);
-    vm->cpu.program_counter += GetInstructionLength(vm, LOAD);
+    vm->cpu.registers[register_index] = -vm->cpu.registers[register_index];
+    vm->cpu.program_counter += GetInstructionLength(vm, NEG);//跳过当前执行完的指令
     return false;
 }
 
 
-//把指定寄存器的值写入指定的内存
-static bool ExecuteStore(TOYVM* vm)
+//将两个寄存器的值相乘，结果存到目标寄存器步骤大同小异
+static bool ExecuteMul(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, STORE))
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, MUL)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
     
-    if (!IsValidRegisterIndex(register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(source_register_index) ||
+                       !IsValidRegisterIndex(target_register_index)))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
-    WriteWord(vm, address, vm->cpu.registers[register_index]);
-    vm->cpu.program_counter += GetInstructionLength(vm, STORE);
+    vm->cpu.registers[target_register_index] *=
+    vm->cpu.registers[source_register_index];
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, MUL);
     return false;
 }
 
 
-//把一个常量值写入指定寄存器
-static bool ExecuteConst(TOYVM* vm)
+//两数相除
+static bool ExecuteDiv(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, CONST))
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, DIV)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    int32_t datum = ReadWord(vm, GetProgramCounter(vm) + 2);
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
     
-    if (!IsValidRegisterIndex(register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(source_register_index) ||
+                       !IsValidRegisterIndex(target_register_index)))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    vm->cpu.registers[register_index] = datum;
-    vm->cpu.program_counter += GetInstructionLength(vm, CONST);
+    vm->cpu.registers[target_register_index] /=
+    vm->cpu.registers[source_register_index];
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, DIV);
     return false;
 }
 
-//从内存指定地址读取数据到寄存器
-static bool ExecuteRload(TOYVM* vm)
+//取模指令
+static bool ExecuteMod(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, RLOAD))
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, MOD)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    uint8_t data_register_index    = ReadByte(vm, GetProgramCounter(vm) + 2);
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
     
-    if (!IsValidRegisterIndex(address_register_index)
-     || !IsValidRegisterIndex(data_register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(source_register_index) ||
+                       !IsValidRegisterIndex(target_register_index)))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
     }
     
-    vm->cpu.registers[data_register_index] =
-        ReadWord(vm, vm->cpu.registers[address_register_index]);
-    vm->cpu.program_counter += GetInstructionLength(vm, RLOAD);
+    vm->cpu.registers[target_register_index] =
+    vm->cpu.registers[source_register_index] %
+    vm->cpu.registers[target_register_index];
+    
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, MOD);
     return false;
 }
 
-//将寄存器中的数据存储到内存地址寄存器所指定的内存位置
-static bool ExecuteRstore(TOYVM* vm)
+
+//根据两个寄存器值的大小关系设置比较标志位
+static void Compare(TOYVM* vm, int32_t register_1, int32_t register_2)
+{
+    if (register_1 < register_2)
+    {
+        vm->cpu.status.COMPARISON_ABOVE = 0;
+        vm->cpu.status.COMPARISON_EQUAL = 0;
+        vm->cpu.status.COMPARISON_BELOW = 1;
+    }
+    else if (register_1 > register_2)
+    {
+        vm->cpu.status.COMPARISON_ABOVE = 1;
+        vm->cpu.status.COMPARISON_EQUAL = 0;
+        vm->cpu.status.COMPARISON_BELOW = 0;
+    }
+    else
+    {
+        vm->cpu.status.COMPARISON_ABOVE = 0;
+        vm->cpu.status.COMPARISON_EQUAL = 1;
+        vm->cpu.status.COMPARISON_BELOW = 0;
+    }
+}
+
+//比较指令
+
+static bool ExecuteCmp(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, RSTORE))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, CMP)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t source_register_index  = ReadByte(vm, GetProgramCounter(vm) + 1);
-    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    uint8_t register_index_1 = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t register_index_2 = ReadByte(vm, GetProgramCounter(vm) + 2);
     
-    if (!IsValidRegisterIndex(source_register_index)
-     || !IsValidRegisterIndex(address_register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index_1) ||
+                       !IsValidRegisterIndex(register_index_2)))
     {
-        vm->cpu.status.BAD_ACCESS = 1;
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    WriteWord(vm,
-              vm->cpu.registers[address_register_index],
-              vm->cpu.registers[source_register_index]);
+    Compare(vm,
+            vm->cpu.registers[register_index_1],
+            vm->cpu.registers[register_index_2]);
     
+    vm->cpu.program_counter += GetInstructionLength(vm, CMP);
     return false;
 }
 
-static void PrintString(TOYVM* vm, uint32_t address)
+
+/*******************************************************************************
+* 覆盖率模式（-DMINVM_COVERAGE）：每次跳转、LOOP、CALL 和 RET 之后，按这条指令的 *
+* 地址和跳转到的地址散列出一个下标，把 coverage_map 中对应的计数器加一，与 AFL  *
+* 的边覆盖位图的用法相同。条件跳转不成立时落到下一条指令，也算一条边。没有设置 *
+* coverage_map 时只多一次判断，不带这个选项编译时这里什么也不做。              *
+*******************************************************************************/
+static inline void RecordEdge(TOYVM* vm, vm_address source)
 {
-    printf("%s", (const char*)(&vm->memory[address]));
+#ifdef MINVM_COVERAGE
+    if (vm->coverage_map != NULL)
+    {
+        uint32_t key = (uint32_t) source * 0x9e3779b1u
+                     ^ (uint32_t) vm->cpu.program_counter;
+        
+        vm->coverage_map[(key ^ key >> 16) & (MINVM_COVERAGE_MAP_SIZE - 1)]++;
+    }
+#endif
 }
 
-static bool ExecuteInterrupt(TOYVM* vm)
+static bool ExecuteJumpIfAbove(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, INT))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, JA)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t interrupt_number = ReadByte(vm, GetProgramCounter(vm) + 1);
+    vm_address program_counter = GetProgramCounter(vm);
     
-    if (StackIsEmpty(vm))
+    if (vm->cpu.status.COMPARISON_ABOVE)
     {
-        vm->cpu.status.STACK_UNDERFLOW = 1;
-        return true;
+        //跳转到下个内存位置所存地址
+        vm->cpu.program_counter = ReadWord(vm, program_counter + 1);
     }
-    
-    switch (interrupt_number)
+    else
     {
-        case INTERRUPT_PRINT_INTEGER:
-            printf("%d", PopVM(vm));
-            break;
-            
-        case INTERRUPT_PRINT_STRING:
-            PrintString(vm, PopVM(vm));
-            break;
-            
-        default:
-            return true;
+        vm->cpu.program_counter += GetInstructionLength(vm, JA);
     }
     
-    vm->cpu.program_counter += GetInstructionLength(vm, INT);
+    RecordEdge(vm, program_counter);
     return false;
 }
 
-static bool ExecutePush(TOYVM* vm)
+static bool ExecuteJumpIfEqual(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, PUSH))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, JE)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (StackIsFull(vm))
+    vm_address program_counter = GetProgramCounter(vm);
+    
+    if (vm->cpu.status.COMPARISON_EQUAL)
     {
-        return true;
+        //跳转到下个内存位置所存地址
+        vm->cpu.program_counter = ReadWord(vm, program_counter + 1);
     }
-    
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    
-    if (!IsValidRegisterIndex(register_index))
+    else
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        vm->cpu.program_counter += GetInstructionLength(vm, JE);
     }
     
-    WriteWord(vm,
-              vm->cpu.stack_pointer - 4,
-              vm->cpu.registers[register_index]);
-    
-    vm->cpu.stack_pointer -= 4;
-    vm->cpu.program_counter += GetInstructionLength(vm, PUSH);
+    RecordEdge(vm, program_counter);
     return false;
 }
 
-static bool ExecutePushAll(TOYVM* vm)
+static bool ExecuteJumpIfBelow(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, PUSH_ALL))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, JB)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (!CanPerformMultipush(vm))
+    vm_address program_counter = GetProgramCounter(vm);
+    
+    if (vm->cpu.status.COMPARISON_BELOW)
     {
-        vm->cpu.status.STACK_OVERFLOW = 1;
-        return true;
+        //跳转到下个内存位置所存地址
+        vm->cpu.program_counter = ReadWord(vm, program_counter + 1);
+    }
+    else
+    {
+        vm->cpu.program_counter += GetInstructionLength(vm, JB);
     }
     
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG1]);
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG2]);
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG3]);
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG4]);
-    vm->cpu.program_counter += GetInstructionLength(vm, PUSH_ALL);
+    RecordEdge(vm, program_counter);
     return false;
 }
 
-static bool ExecutePop(TOYVM* vm)
+static bool ExecuteJump(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, POP))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, JMP)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (StackIsEmpty(vm))
+    //跳转指令
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.program_counter = ReadWord(vm, program_counter + 1);
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+/*******************************************************************************
+* LOOP REGi ADDRESS: 计数循环指令。把 REGi 减一，结果不为零时跳转到 ADDRESS，否则顺序   *
+* 执行下一条指令。一条指令代替循环尾部的 ADD、CMP 和条件跳转，不修改比较标志位。       *
+*******************************************************************************/
+static bool ExecuteLoop(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, LOOP)))
     {
+        vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
     uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
     
-    if (!IsValidRegisterIndex(register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    int32_t datum = ReadWord(vm, vm->cpu.stack_pointer+4);
-    vm->cpu.registers[register_index] = datum;
-    vm->cpu.stack_pointer += 4;
-    vm->cpu.program_counter += GetInstructionLength(vm, POP);
+    vm_address program_counter = GetProgramCounter(vm);
+    
+    if (--vm->cpu.registers[register_index] != 0)
+    {
+        vm->cpu.program_counter = ReadWord(vm, program_counter + 2);
+    }
+    else
+    {
+        vm->cpu.program_counter += GetInstructionLength(vm, LOOP);
+    }
+    
+    RecordEdge(vm, program_counter);
     return false;
 }
 
-static bool ExecutePopAll(TOYVM* vm)
+static bool ExecuteCall(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, CALL)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    //读取需要调用的函数起始地址
+    vm_address program_counter = GetProgramCounter(vm);
+    uint32_t address = ReadWord(vm, program_counter + 1);
+    vm_address return_address = program_counter +
+                                (vm_address) GetInstructionLength(vm, CALL);
+    
+    if (MINVM_UNLIKELY(!StackHasRoom(vm, sizeof(int32_t))))
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    //保存当前执行位置到堆栈，然后跳转
+    PushVM(vm, (uint32_t) return_address);
+    vm->cpu.program_counter = address;
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+
+//函数执行结束，返回调用函数的地方
+static bool ExecuteRet(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, POP_ALL))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, RET)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (!CanPerformMultipop(vm))
+    if (MINVM_UNLIKELY(!StackHasData(vm, sizeof(int32_t))))
     {
         vm->cpu.status.STACK_UNDERFLOW = 1;
         return true;
     }
     
-    vm->cpu.registers[REG4] = ReadWord(vm, vm->cpu.stack_pointer);
-    vm->cpu.registers[REG3] = ReadWord(vm, vm->cpu.stack_pointer + 4);
-    vm->cpu.registers[REG2] = ReadWord(vm, vm->cpu.stack_pointer + 8);
-    vm->cpu.registers[REG1] = ReadWord(vm, vm->cpu.stack_pointer + 12);
-    vm->cpu.stack_pointer += 16;
-    vm->cpu.program_counter += GetInstructionLength(vm, POP_ALL);
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.program_counter = PopVM(vm);
+    RecordEdge(vm, program_counter);
     return false;
 }
 
-static bool ExecuteLSP(TOYVM* vm)
+
+static bool WideAddressFitsInMemory(TOYVM* vm, uint64_t address)
+{
+    return address <= (uint64_t) vm->memory_size - sizeof(int32_t);
+}
+
+/*******************************************************************************
+* LOAD/STORE/RLOAD/RSTORE 的地址由客户机给出。平坦内存和保护页模式下按         *
+* LOADW/STOREW 的方式检查，越界的访问设置 BAD_ACCESS；屏蔽模式下地址折回       *
+* 内存中，分页模式下越界的地址落到 void_page 上，都不会越界，不需要检查。      *
+*******************************************************************************/
+static bool GuestAddressFitsInMemory(TOYVM* vm, vm_address address)
+{
+#if defined(MINVM_MASKED_MEMORY) || defined(MINVM_PAGED_MEMORY)
+    return true;
+#else
+    return WideAddressFitsInMemory(vm, (vm_unsigned_address) address);
+#endif
+}
+
+//把内存中的数据读到指定寄存器
+static bool ExecuteLoad(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, LSP))
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, LOAD)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
+    //读取寄存器索引
     uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
     
-    if (!IsValidRegisterIndex(register_index))
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    vm->cpu.registers[register_index] = vm->cpu.stack_pointer;
-    vm->cpu.program_counter += GetInstructionLength(vm, LSP);
-    return false;
-}
 
-static bool ExecuteNop(TOYVM* vm) {
-    if (!InstructionFitsInMemory(vm, NOP))
+
+    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!GuestAddressFitsInMemory(vm, address)))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    vm->cpu.program_counter += GetInstructionLength(vm, NOP);
+    vm->cpu.registers[register_index] = ReadWord(vm, address);
+    vm->cpu.program_counter += GetInstructionLength(vm, LOAD);
     return false;
 }
 
-static bool ExecuteHalt(TOYVM* vm) {
-    return true;
-}
 
-void PrintStatus(TOYVM* vm)
+//把指定寄存器的值写入指定的内存
+static bool ExecuteStore(TOYVM* vm)
 {
-    printf("BAD_INSTRUCTION       : %d\n", vm->cpu.status.BAD_INSTRUCTION);
-    printf("STACK_UNDERFLOW       : %d\n", vm->cpu.status.STACK_UNDERFLOW);
-    printf("STACK_OVERFLOW        : %d\n", vm->cpu.status.STACK_OVERFLOW);
-    printf("INVALID_REGISTER_INDEX: %d\n",
-           vm->cpu.status.INVALID_REGISTER_INDEX);
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, STORE)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!GuestAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
     
-    printf("BAD_ACCESS            : %d\n", vm->cpu.status.BAD_ACCESS);
-    printf("COMPARISON_ABOVE      : %d\n", vm->cpu.status.COMPARISON_ABOVE);
-    printf("COMPARISON_EQUAL      : %d\n", vm->cpu.status.COMPARISON_EQUAL);
-    printf("COMPARISON_BELOW      : %d\n", vm->cpu.status.COMPARISON_BELOW);
+    WriteWord(vm, address, vm->cpu.registers[register_index]);
+    vm->cpu.program_counter += GetInstructionLength(vm, STORE);
+    return false;
 }
 
-/*
-opcode: 表示指令的操作码，是一个 8 位的无符号整数。
-size: 表示指令的长度，是一个 size_t 类型的整数，表示该指令占用的字节数。
-execute: 是一个函数指针，指向实现该指令功能的函数。这些函数在之前的代码中都有实现。
-*/
-const instruction instructions[] = {
-    { 0,        0, NULL       },
-    { ADD,      3, ExecuteAdd },
-    { NEG,      2, ExecuteNeg },
-    { MUL,      3, ExecuteMul },
-    { DIV,      3, ExecuteDiv },
-    { MOD,      3, ExecuteMod },
-    
-    { CMP,      3, ExecuteCmp },
-    { JA,       5, ExecuteJumpIfAbove },
-    { JE,       5, ExecuteJumpIfEqual },
-    { JB,       5, ExecuteJumpIfBelow },
-    { JMP,      5, ExecuteJump },
-    
-    { CALL,     5, ExecuteCall },
-    { RET,      1, ExecuteRet },
-    
-    { LOAD,     6, ExecuteLoad },
-    { STORE,    6, ExecuteStore },
-    { CONST,    6, ExecuteConst },
-    { RLOAD,    3, ExecuteRload },
-    { RSTORE,   3, ExecuteRstore },
-    
-    { HALT,     1, ExecuteHalt },
-    { INT,      2, ExecuteInterrupt },
-    { NOP,      1, ExecuteNop },
-    
-    { PUSH,     2, ExecutePush },
-    { PUSH_ALL, 1, ExecutePushAll },
-    { POP,      2, ExecutePop },
-    { POP_ALL,  1, ExecutePopAll },
-    { LSP,      2, ExecuteLSP }
-};
-
-static size_t GetInstructionLength(TOYVM* vm, uint8_t opcode)
-{
-    size_t index = vm->opcode_map[opcode];
-    return instructions[index].size;
-}
 
-//用于检查指令是否在虚拟机的内存空间中。它接受虚拟机实例 vm 和指令的操作码 opcode 作为参数。
-static bool InstructionFitsInMemory(TOYVM* vm, uint8_t opcode)
+/*******************************************************************************
+* LOADW/STOREW 的地址操作数是 64 位的，可以访问 4 GiB 以外的内存。地址在这里显式 *
+* 检查，超出内存的访问设置 BAD_ACCESS。                                         *
+*******************************************************************************/
+static uint64_t ReadWideAddress(TOYVM* vm, vm_address address)
 {
-    size_t instruction_length = GetInstructionLength(vm, opcode);
-    return vm->cpu.program_counter + instruction_length <= vm->memory_size;
+    return (uint64_t)(uint32_t) ReadWord(vm, address)
+         | (uint64_t)(uint32_t) ReadWord(vm, address + 4) << 32;
 }
 
-void RunVM(TOYVM* vm)
+//LOADW REGi ADDRESS64
+static bool ExecuteLoadWide(TOYVM* vm)
 {
-    while (true)
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, LOADW)))
     {
-        int32_t program_counter = GetProgramCounter(vm);
-        
-        if (program_counter < 0 || program_counter >= vm->memory_size)
-        {
-            vm->cpu.status.BAD_ACCESS = 1;
-            return;
-        }
-        
-        uint8_t opcode = vm->memory[program_counter];
-        size_t index = vm->opcode_map[opcode];
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
     
-        if (index == 0)
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    uint64_t address = ReadWideAddress(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!WideAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = ReadWord(vm, (vm_address) address);
+    vm->cpu.program_counter += GetInstructionLength(vm, LOADW);
+    return false;
+}
+
+//STOREW REGi ADDRESS64
+static bool ExecuteStoreWide(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, STOREW)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    uint64_t address = ReadWideAddress(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!WideAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    WriteWord(vm, (vm_address) address, vm->cpu.registers[register_index]);
+    vm->cpu.program_counter += GetInstructionLength(vm, STOREW);
+    return false;
+}
+
+
+//把一个常量值写入指定寄存器
+static bool ExecuteConst(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, CONST)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    int32_t datum = ReadWord(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = datum;
+    vm->cpu.program_counter += GetInstructionLength(vm, CONST);
+    return false;
+}
+
+//从内存指定地址读取数据到寄存器
+static bool ExecuteRload(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, RLOAD)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t data_register_index    = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(address_register_index)
+                    || !IsValidRegisterIndex(data_register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm_address address = vm->cpu.registers[address_register_index];
+    
+    if (MINVM_UNLIKELY(!GuestAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[data_register_index] = ReadWord(vm, address);
+    vm->cpu.program_counter += GetInstructionLength(vm, RLOAD);
+    return false;
+}
+
+//将寄存器中的数据存储到内存地址寄存器所指定的内存位置
+static bool ExecuteRstore(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, RSTORE)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t source_register_index  = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(source_register_index)
+                    || !IsValidRegisterIndex(address_register_index)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm_address address = vm->cpu.registers[address_register_index];
+    
+    if (MINVM_UNLIKELY(!GuestAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    WriteWord(vm, address, vm->cpu.registers[source_register_index]);
+    vm->cpu.program_counter += GetInstructionLength(vm, RSTORE);
+    return false;
+}
+
+//打印内存中以 '\0' 结尾的字符串，最多打印到内存（或保护页）的边界为止
+static void PrintString(TOYVM* vm, vm_unsigned_address address)
+{
+    vm_unsigned_address end = (vm_unsigned_address) vm->memory_size;
+    
+    address = MINVM_GUEST_ADDRESS(vm, address);
+    
+#ifdef MINVM_GUARD_PAGE
+    if (address < (vm_unsigned_address) vm->stack_limit)
+    {
+        end = (vm_unsigned_address) GetGuardPage(vm);
+    }
+#endif
+    
+    if (address >= end)
+    {
+        return;
+    }
+    
+#ifdef MINVM_PAGED_MEMORY
+    //字符串可能跨页，逐个字节输出
+    for (uint8_t byte; address < end && (byte = ReadByte(vm, address)); ++address)
+    {
+        fputc(byte, vm->output);
+    }
+#else
+    const char* string = (const char*)(&vm->memory[address]);
+    fwrite(string, 1, strnlen(string, end - address), vm->output);
+#endif
+}
+
+static bool ExecuteInterrupt(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, INT)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t interrupt_number = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!StackHasData(vm, sizeof(int32_t))))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    switch (interrupt_number)
+    {
+        case INTERRUPT_PRINT_INTEGER:
+            fprintf(vm->output, "%d", PopVM(vm));
+            break;
+            
+        case INTERRUPT_PRINT_STRING:
+            PrintString(vm, (uint32_t) PopVM(vm));
+            break;
+            
+        default:
+            return true;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, INT);
+    return false;
+}
+
+static bool ExecutePush(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, PUSH)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (MINVM_UNLIKELY(!StackHasRoom(vm, sizeof(int32_t))))
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    /***************************************************************************
+    * PUSH REGi 后面紧跟 POP REGj 时，压入的值马上又被弹出，栈指针不变，效果   *
+    * 等同于把 REGi 复制到 REGj。这里直接复制寄存器并跳过这两条指令，省掉一次  *
+    * 内存写、一次内存读和一次分派。栈指针以下的那个字本来就是无效数据，不写入 *
+    * 它并不影响程序的行为。栈满时不合并，由下面的写入报告 STACK_OVERFLOW。    *
+    ***************************************************************************/
+    vm_address next_program_counter = GetProgramCounter(vm) +
+                                      (vm_address) GetInstructionLength(vm, PUSH);
+    
+    if (StackFitsBelowPointer(vm, sizeof(int32_t))
+        && next_program_counter + (vm_address) GetInstructionLength(vm, POP)
+            <= vm->memory_size
+        && ReadByte(vm, next_program_counter) == POP)
+    {
+        uint8_t pop_register_index = ReadByte(vm, next_program_counter + 1);
+        
+        if (IsValidRegisterIndex(pop_register_index))
+        {
+            vm->cpu.registers[pop_register_index] =
+                vm->cpu.registers[register_index];
+            vm->cpu.program_counter = next_program_counter +
+                                      (vm_address) GetInstructionLength(vm, POP);
+            return false;
+        }
+    }
+    
+    WriteWord(vm,
+              vm->cpu.stack_pointer - 4,
+              vm->cpu.registers[register_index]);
+    
+    vm->cpu.stack_pointer -= 4;
+    vm->cpu.program_counter += GetInstructionLength(vm, PUSH);
+    return false;
+}
+
+static bool ExecutePushAll(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, PUSH_ALL)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (MINVM_UNLIKELY(!StackHasRoom(vm, sizeof(int32_t) * N_REGISTERS)))
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    WriteWord(vm, vm->cpu.stack_pointer - 4,  vm->cpu.registers[REG1]);
+    WriteWord(vm, vm->cpu.stack_pointer - 8,  vm->cpu.registers[REG2]);
+    WriteWord(vm, vm->cpu.stack_pointer - 12, vm->cpu.registers[REG3]);
+    WriteWord(vm, vm->cpu.stack_pointer - 16, vm->cpu.registers[REG4]);
+    vm->cpu.stack_pointer -= 16;
+    vm->cpu.program_counter += GetInstructionLength(vm, PUSH_ALL);
+    return false;
+}
+
+static bool ExecutePop(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, POP)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (MINVM_UNLIKELY(!StackHasData(vm, sizeof(int32_t))))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    int32_t datum = ReadWord(vm, vm->cpu.stack_pointer);
+    vm->cpu.registers[register_index] = datum;
+    vm->cpu.stack_pointer += 4;
+    vm->cpu.program_counter += GetInstructionLength(vm, POP);
+    return false;
+}
+
+static bool ExecutePopAll(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, POP_ALL)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (MINVM_UNLIKELY(!StackHasData(vm, sizeof(int32_t) * N_REGISTERS)))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[REG4] = ReadWord(vm, vm->cpu.stack_pointer);
+    vm->cpu.registers[REG3] = ReadWord(vm, vm->cpu.stack_pointer + 4);
+    vm->cpu.registers[REG2] = ReadWord(vm, vm->cpu.stack_pointer + 8);
+    vm->cpu.registers[REG1] = ReadWord(vm, vm->cpu.stack_pointer + 12);
+    vm->cpu.stack_pointer += 16;
+    vm->cpu.program_counter += GetInstructionLength(vm, POP_ALL);
+    return false;
+}
+
+static bool ExecuteLSP(TOYVM* vm)
+{
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, LSP)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (MINVM_UNLIKELY(!IsValidRegisterIndex(register_index)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = (int32_t) vm->cpu.stack_pointer;
+    vm->cpu.program_counter += GetInstructionLength(vm, LSP);
+    return false;
+}
+
+static bool ExecuteNop(TOYVM* vm) {
+    if (MINVM_UNLIKELY(!InstructionFitsInMemory(vm, NOP)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, NOP);
+    return false;
+}
+
+static bool ExecuteHalt(TOYVM* vm) {
+    return true;
+}
+
+static bool ExecuteBadInstruction(TOYVM* vm)
+{
+    vm->cpu.status.BAD_INSTRUCTION = 1;
+    return true;
+}
+
+void PrintStatus(TOYVM* vm)
+{
+    FILE* output = vm->output;
+    
+    fprintf(output, "BAD_INSTRUCTION       : %d\n",
+            vm->cpu.status.BAD_INSTRUCTION);
+    fprintf(output, "STACK_UNDERFLOW       : %d\n",
+            vm->cpu.status.STACK_UNDERFLOW);
+    fprintf(output, "STACK_OVERFLOW        : %d\n",
+            vm->cpu.status.STACK_OVERFLOW);
+    fprintf(output, "INVALID_REGISTER_INDEX: %d\n",
+            vm->cpu.status.INVALID_REGISTER_INDEX);
+    
+    fprintf(output, "BAD_ACCESS            : %d\n", vm->cpu.status.BAD_ACCESS);
+    fprintf(output, "COMPARISON_ABOVE      : %d\n",
+            vm->cpu.status.COMPARISON_ABOVE);
+    fprintf(output, "COMPARISON_EQUAL      : %d\n",
+            vm->cpu.status.COMPARISON_EQUAL);
+    fprintf(output, "COMPARISON_BELOW      : %d\n",
+            vm->cpu.status.COMPARISON_BELOW);
+}
+
+/*
+opcode: 表示指令的操作码，是一个 8 位的无符号整数。
+size: 表示指令的长度，是一个 size_t 类型的整数，表示该指令占用的字节数。
+execute: 是一个函数指针，指向实现该指令功能的函数。这些函数在之前的代码中都有实现。
+表直接按操作码索引，未定义的操作码由 FillInstructionTable 映射到 ExecuteBadInstruction，RunVM 查一次表即可分派。
+*/
+static instruction instructions[OPCODE_MAP_SIZE] = {
+    [ADD]      = { ADD,      3, ExecuteAdd },
+    [NEG]      = { NEG,      2, ExecuteNeg },
+    [MUL]      = { MUL,      3, ExecuteMul },
+    [DIV]      = { DIV,      3, ExecuteDiv },
+    [MOD]      = { MOD,      3, ExecuteMod },
+    
+    [CMP]      = { CMP,      3, ExecuteCmp },
+    [JA]       = { JA,       5, ExecuteJumpIfAbove },
+    [JE]       = { JE,       5, ExecuteJumpIfEqual },
+    [JB]       = { JB,       5, ExecuteJumpIfBelow },
+    [JMP]      = { JMP,      5, ExecuteJump },
+    [LOOP]     = { LOOP,     6, ExecuteLoop },
+    
+    [CALL]     = { CALL,     5, ExecuteCall },
+    [RET]      = { RET,      1, ExecuteRet },
+    
+    [LOAD]     = { LOAD,     6, ExecuteLoad },
+    [STORE]    = { STORE,    6, ExecuteStore },
+    [CONST]    = { CONST,    6, ExecuteConst },
+    [RLOAD]    = { RLOAD,    3, ExecuteRload },
+    [RSTORE]   = { RSTORE,   3, ExecuteRstore },
+    [LOADW]    = { LOADW,   10, ExecuteLoadWide },
+    [STOREW]   = { STOREW,  10, ExecuteStoreWide },
+    
+    [HALT]     = { HALT,     1, ExecuteHalt },
+    [INT]      = { INT,      2, ExecuteInterrupt },
+    [NOP]      = { NOP,      1, ExecuteNop },
+    
+    [PUSH]     = { PUSH,     2, ExecutePush },
+    [PUSH_ALL] = { PUSH_ALL, 1, ExecutePushAll },
+    [POP]      = { POP,      2, ExecutePop },
+    [POP_ALL]  = { POP_ALL,  1, ExecutePopAll },
+    [LSP]      = { LSP,      2, ExecuteLSP },
+};
+
+static void FillInstructionTable(void)
+{
+    for (size_t opcode = 0; opcode < OPCODE_MAP_SIZE; ++opcode)
+    {
+        if (instructions[opcode].execute == NULL)
+        {
+            instructions[opcode].execute = ExecuteBadInstruction;
+        }
+    }
+}
+
+static size_t GetInstructionLength(TOYVM* vm, uint8_t opcode)
+{
+    return instructions[opcode].size;
+}
+
+//用于检查指令是否在虚拟机的内存空间中。它接受虚拟机实例 vm 和指令的操作码 opcode 作为参数。
+static bool InstructionFitsInMemory(TOYVM* vm, uint8_t opcode)
+{
+    vm_unsigned_address instruction_length =
+        (vm_unsigned_address) GetInstructionLength(vm, opcode);
+    
+    //程序计数器已经由解释器检查过在内存之内，相减不会回绕
+    return instruction_length
+           <= (vm_unsigned_address) (vm->memory_size - vm->cpu.program_counter);
+}
+
+/*******************************************************************************
+* 加速（quickening）后的指令版本。一条指令第一次执行时由 ExecuteAndQuicken 检查  *
+* 它是否完整地位于内存中、寄存器索引是否有效，检查通过后在 quick_code 中记下对应 *
+* 的加速版本，以后再执行到这里时就跳过这些检查。指令所在的内存被改写时，         *
+* InvalidateQuickCode 会把记录清除，下次执行时重新校验。                       *
+*******************************************************************************/
+static bool ExecuteAddQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.registers[ReadByte(vm, program_counter + 2)] +=
+        vm->cpu.registers[ReadByte(vm, program_counter + 1)];
+    vm->cpu.program_counter = program_counter + 3;
+    return false;
+}
+
+static bool ExecuteNegQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    uint8_t register_index = ReadByte(vm, program_counter + 1);
+    vm->cpu.registers[register_index] = -vm->cpu.registers[register_index];
+    vm->cpu.program_counter = program_counter + 2;
+    return false;
+}
+
+static bool ExecuteMulQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.registers[ReadByte(vm, program_counter + 2)] *=
+        vm->cpu.registers[ReadByte(vm, program_counter + 1)];
+    vm->cpu.program_counter = program_counter + 3;
+    return false;
+}
+
+static bool ExecuteCmpQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    Compare(vm,
+            vm->cpu.registers[ReadByte(vm, program_counter + 1)],
+            vm->cpu.registers[ReadByte(vm, program_counter + 2)]);
+    vm->cpu.program_counter = program_counter + 3;
+    return false;
+}
+
+static bool ExecuteJumpIfAboveQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.program_counter = vm->cpu.status.COMPARISON_ABOVE
+                            ? ReadWord(vm, program_counter + 1)
+                            : program_counter + 5;
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+static bool ExecuteJumpIfEqualQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.program_counter = vm->cpu.status.COMPARISON_EQUAL
+                            ? ReadWord(vm, program_counter + 1)
+                            : program_counter + 5;
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+static bool ExecuteJumpIfBelowQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.program_counter = vm->cpu.status.COMPARISON_BELOW
+                            ? ReadWord(vm, program_counter + 1)
+                            : program_counter + 5;
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+static bool ExecuteJumpQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.program_counter = ReadWord(vm, program_counter + 1);
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+static bool ExecuteLoopQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    uint8_t register_index = ReadByte(vm, program_counter + 1);
+    vm->cpu.program_counter = --vm->cpu.registers[register_index] != 0
+                            ? ReadWord(vm, program_counter + 2)
+                            : program_counter + 6;
+    RecordEdge(vm, program_counter);
+    return false;
+}
+
+static bool ExecuteLoadQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    uint32_t address = ReadWord(vm, program_counter + 2);
+    
+    if (MINVM_UNLIKELY(!GuestAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[ReadByte(vm, program_counter + 1)] =
+        ReadWord(vm, address);
+    vm->cpu.program_counter = program_counter + 6;
+    return false;
+}
+
+static bool ExecuteStoreQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    uint32_t address = ReadWord(vm, program_counter + 2);
+    
+    if (MINVM_UNLIKELY(!GuestAddressFitsInMemory(vm, address)))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    WriteWord(vm,
+              address,
+              vm->cpu.registers[ReadByte(vm, program_counter + 1)]);
+    vm->cpu.program_counter = program_counter + 6;
+    return false;
+}
+
+static bool ExecuteConstQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.registers[ReadByte(vm, program_counter + 1)] =
+        ReadWord(vm, program_counter + 2);
+    vm->cpu.program_counter = program_counter + 6;
+    return false;
+}
+
+static bool ExecuteNopQuick(TOYVM* vm)
+{
+    vm->cpu.program_counter += 1;
+    return false;
+}
+
+/*******************************************************************************
+* 超级指令：CMP 后紧跟条件跳转、CONST 后紧跟 ADD 是循环中最常见的指令对（可以用  *
+* MINVM_PROFILE 统计得到），把它们合并为一次分派。                             *
+*******************************************************************************/
+static bool ExecuteCmpJumpIfAboveQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    Compare(vm,
+            vm->cpu.registers[ReadByte(vm, program_counter + 1)],
+            vm->cpu.registers[ReadByte(vm, program_counter + 2)]);
+    vm->cpu.program_counter = vm->cpu.status.COMPARISON_ABOVE
+                            ? ReadWord(vm, program_counter + 4)
+                            : program_counter + 8;
+    RecordEdge(vm, program_counter + 3);
+    return false;
+}
+
+static bool ExecuteCmpJumpIfEqualQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    Compare(vm,
+            vm->cpu.registers[ReadByte(vm, program_counter + 1)],
+            vm->cpu.registers[ReadByte(vm, program_counter + 2)]);
+    vm->cpu.program_counter = vm->cpu.status.COMPARISON_EQUAL
+                            ? ReadWord(vm, program_counter + 4)
+                            : program_counter + 8;
+    RecordEdge(vm, program_counter + 3);
+    return false;
+}
+
+static bool ExecuteCmpJumpIfBelowQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    Compare(vm,
+            vm->cpu.registers[ReadByte(vm, program_counter + 1)],
+            vm->cpu.registers[ReadByte(vm, program_counter + 2)]);
+    vm->cpu.program_counter = vm->cpu.status.COMPARISON_BELOW
+                            ? ReadWord(vm, program_counter + 4)
+                            : program_counter + 8;
+    RecordEdge(vm, program_counter + 3);
+    return false;
+}
+
+static bool ExecuteConstAddQuick(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm->cpu.registers[ReadByte(vm, program_counter + 1)] =
+        ReadWord(vm, program_counter + 2);
+    vm->cpu.registers[ReadByte(vm, program_counter + 8)] +=
+        vm->cpu.registers[ReadByte(vm, program_counter + 7)];
+    vm->cpu.program_counter = program_counter + 9;
+    return false;
+}
+
+//没有加速版本的指令仍按内存中的操作码走普通的（带检查的）执行函数
+static bool ExecuteGeneric(TOYVM* vm)
+{
+    uint8_t opcode = ReadByte(vm, GetProgramCounter(vm));
+    return instructions[opcode].execute(vm);
+}
+
+/*******************************************************************************
+* 校验位于程序计数器处的指令，返回它的加速版本。校验失败时返回 QUICK_NONE，由普 *
+* 通的执行函数去设置相应的错误标志位。                                         *
+*******************************************************************************/
+static uint8_t QuickenInstruction(TOYVM* vm, uint8_t opcode)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    
+    switch (opcode)
+    {
+        case ADD:
+        case MUL:
+        case CMP:
+        case NEG:
+        case LOOP:
+        case LOAD:
+        case STORE:
+        case CONST:
+        case JA:
+        case JE:
+        case JB:
+        case JMP:
+        case NOP:
+            break;
+            
+        default:
+            return QUICK_GENERIC;
+    }
+    
+    if (!InstructionFitsInMemory(vm, opcode))
+    {
+        return QUICK_NONE;
+    }
+    
+    uint8_t operand_1 = opcode == NOP ? REG1 : ReadByte(vm, program_counter + 1);
+    uint8_t operand_2 = instructions[opcode].size > 2
+                      ? ReadByte(vm, program_counter + 2)
+                      : REG1;
+    
+    switch (opcode)
+    {
+        case ADD:
+        case MUL:
+        case CMP:
+            if (!IsValidRegisterIndex(operand_1)
+             || !IsValidRegisterIndex(operand_2))
+            {
+                return QUICK_NONE;
+            }
+            
+            return opcode == ADD ? QUICK_ADD
+                 : opcode == MUL ? QUICK_MUL
+                 : QUICK_CMP;
+            
+        case NEG:
+        case LOOP:
+        case LOAD:
+        case STORE:
+        case CONST:
+            if (!IsValidRegisterIndex(operand_1))
+            {
+                return QUICK_NONE;
+            }
+            
+            return opcode == NEG   ? QUICK_NEG
+                 : opcode == LOOP  ? QUICK_LOOP
+                 : opcode == LOAD  ? QUICK_LOAD
+                 : opcode == STORE ? QUICK_STORE
+                 : QUICK_CONST;
+            
+        case JA:  return QUICK_JA;
+        case JE:  return QUICK_JE;
+        case JB:  return QUICK_JB;
+        case JMP: return QUICK_JMP;
+        default:  return QUICK_NOP;
+    }
+}
+
+#ifndef MINVM_PROFILE
+/*******************************************************************************
+* 已经加速的 CMP 或 CONST 之后如果紧跟着可以合并的指令，返回对应的超级指令，否则 *
+* 原样返回 quick_opcode。跳转到后一条指令的程序不受影响，因为后一条指令在        *
+* quick_code 中有自己的记录。                                                  *
+*******************************************************************************/
+static uint8_t FuseQuickInstruction(TOYVM* vm, uint8_t quick_opcode)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    vm_address next = program_counter + (vm_address)
+                      GetInstructionLength(vm, ReadByte(vm, program_counter));
+    
+    if (next >= vm->memory_size)
+    {
+        return quick_opcode;
+    }
+    
+    uint8_t next_opcode = ReadByte(vm, next);
+    
+    if (next + (vm_address) GetInstructionLength(vm, next_opcode)
+        > vm->memory_size)
+    {
+        return quick_opcode;
+    }
+    
+    if (quick_opcode == QUICK_CMP)
+    {
+        switch (next_opcode)
+        {
+            case JA: return QUICK_CMP_JA;
+            case JE: return QUICK_CMP_JE;
+            case JB: return QUICK_CMP_JB;
+        }
+    }
+    else if (quick_opcode == QUICK_CONST && next_opcode == ADD
+             && IsValidRegisterIndex(ReadByte(vm, next + 1))
+             && IsValidRegisterIndex(ReadByte(vm, next + 2)))
+    {
+        return QUICK_CONST_ADD;
+    }
+    
+    return quick_opcode;
+}
+#endif
+
+static const instruction quick_instructions[N_QUICK_OPCODES];
+
+/*******************************************************************************
+* quick_code 中为 QUICK_NONE 的指令由这里执行：先尝试加速并记录下来，再执行这  *
+* 条指令的加速版本，以后就会直接分派到记录下来的版本。记录的可能是合并的指令   *
+* 对，但这一次只执行前一条，预算也只算一条。无法加速（校验失败）时交给普通的   *
+* 执行函数报告错误。                                                           *
+*******************************************************************************/
+static bool ExecuteAndQuicken(TOYVM* vm)
+{
+    vm_address program_counter = GetProgramCounter(vm);
+    uint8_t opcode = ReadByte(vm, program_counter);
+    uint8_t quick_opcode = QuickenInstruction(vm, opcode);
+    
+    if (quick_opcode == QUICK_NONE)
+    {
+        return instructions[opcode].execute(vm);
+    }
+    
+#ifndef MINVM_PROFILE
+    //统计指令对时不合并，否则被合并的后一条指令不会被计数
+    vm->quick_code[program_counter] = FuseQuickInstruction(vm, quick_opcode);
+#else
+    vm->quick_code[program_counter] = quick_opcode;
+#endif
+    MarkDirtyPages(vm, program_counter, 1);
+    return quick_instructions[quick_opcode].execute(vm);
+}
+
+static const instruction quick_instructions[N_QUICK_OPCODES] = {
+    [QUICK_NONE]    = { 0,     0, ExecuteAndQuicken },
+    [QUICK_GENERIC] = { 0,     0, ExecuteGeneric },
+    [QUICK_ADD]     = { ADD,   3, ExecuteAddQuick },
+    [QUICK_NEG]     = { NEG,   2, ExecuteNegQuick },
+    [QUICK_MUL]     = { MUL,   3, ExecuteMulQuick },
+    [QUICK_CMP]     = { CMP,   3, ExecuteCmpQuick },
+    [QUICK_JA]      = { JA,    5, ExecuteJumpIfAboveQuick },
+    [QUICK_JE]      = { JE,    5, ExecuteJumpIfEqualQuick },
+    [QUICK_JB]      = { JB,    5, ExecuteJumpIfBelowQuick },
+    [QUICK_JMP]     = { JMP,   5, ExecuteJumpQuick },
+    [QUICK_LOOP]    = { LOOP,  6, ExecuteLoopQuick },
+    [QUICK_LOAD]    = { LOAD,  6, ExecuteLoadQuick },
+    [QUICK_STORE]   = { STORE, 6, ExecuteStoreQuick },
+    [QUICK_CONST]   = { CONST, 6, ExecuteConstQuick },
+    [QUICK_NOP]     = { NOP,   1, ExecuteNopQuick },
+    
+    [QUICK_CMP_JA]    = { CMP,   8, ExecuteCmpJumpIfAboveQuick },
+    [QUICK_CMP_JE]    = { CMP,   8, ExecuteCmpJumpIfEqualQuick },
+    [QUICK_CMP_JB]    = { CMP,   8, ExecuteCmpJumpIfBelowQuick },
+    [QUICK_CONST_ADD] = { CONST, 9, ExecuteConstAddQuick },
+};
+
+/*******************************************************************************
+* 程序映像：预先对程序中每个字节偏移处的指令做 ExecuteAndQuicken 会做的校验，把  *
+* 结果和程序一起保存。加载映像时直接复制这份结果，同一个程序在每台虚拟机上只校 *
+* 验一次。只记录完整位于程序之内的指令（包括合并的后一条指令），因为程序之后的 *
+* 内存在每台虚拟机上可能不同。                                                 *
+*******************************************************************************/
+bool CreateVMImage(VM_IMAGE* image, const uint8_t* code, size_t size)
+{
+    TOYVM vm;
+    
+    image->size       = size;
+    image->code       = (uint8_t*)malloc(size);
+    image->quick_code = (uint8_t*)calloc(size, sizeof(uint8_t));
+    
+    if (size != 0 && (image->code == NULL || image->quick_code == NULL))
+    {
+        FreeVMImage(image);
+        return false;
+    }
+    
+    memcpy(image->code, code, size);
+    
+    //整个程序都在栈界限之下，保护页模式下保护页在程序之后而不会与它重叠
+    if (!InitializeVM(&vm, (vm_address) size, (vm_address) size))
+    {
+        FreeVMImage(image);
+        return false;
+    }
+    
+    WriteVMMemoryAt(&vm, 0, code, size);
+    
+    for (size_t offset = 0; offset < size; ++offset)
+    {
+        vm.cpu.program_counter = (vm_address) offset;
+        
+        uint8_t quick_opcode = QuickenInstruction(&vm, ReadByte(&vm, offset));
+        
+        if (quick_opcode == QUICK_NONE)
+        {
+            continue;
+        }
+        
+#ifndef MINVM_PROFILE
+        quick_opcode = FuseQuickInstruction(&vm, quick_opcode);
+#endif
+        if (quick_instructions[quick_opcode].size <= size - offset)
+        {
+            image->quick_code[offset] = quick_opcode;
+        }
+    }
+    
+    FreeVM(&vm);
+    return true;
+}
+
+void LoadVMImage(TOYVM* vm, const VM_IMAGE* image)
+{
+    WriteVMMemory(vm, image->code, image->size);
+    
+    if (vm->engine == ENGINE_INTERPRETER)
+    {
+        return;
+    }
+    
+    if (vm->quick_code == NULL)
+    {
+        vm->quick_code = (uint8_t*)calloc(vm->memory_size, sizeof(uint8_t));
+        
+        if (vm->quick_code == NULL)
+        {
+            return;
+        }
+    }
+    
+    memcpy(vm->quick_code, image->quick_code, image->size);
+}
+
+void FreeVMImage(VM_IMAGE* image)
+{
+    free(image->code);
+    free(image->quick_code);
+    image->code       = NULL;
+    image->quick_code = NULL;
+}
+
+//在 destination 和 source 之间拷贝虚拟机的内存，保护页不可访问，跳过它
+#ifndef MINVM_PAGED_MEMORY
+static void CopyVMMemory(const TOYVM* vm, uint8_t* destination,
+                         const uint8_t* source)
+{
+#ifdef MINVM_GUARD_PAGE
+    vm_address guard_page = GetGuardPage((TOYVM*) vm);
+    memcpy(destination, source, guard_page);
+    memcpy(destination + vm->stack_limit, source + vm->stack_limit,
+           vm->memory_size - vm->stack_limit);
+#else
+    memcpy(destination, source, vm->memory_size);
+#endif
+}
+#endif
+
+bool SnapshotVM(TOYVM* vm, VM_SNAPSHOT* snapshot)
+{
+    memset(snapshot, 0, sizeof(VM_SNAPSHOT));
+    snapshot->cpu         = vm->cpu;
+    snapshot->fuel        = vm->fuel;
+    snapshot->memory_size = vm->memory_size;
+    
+#ifdef MINVM_PAGED_MEMORY
+    //只拷贝已经分配的页
+    size_t page_count = ((vm_unsigned_address) vm->memory_size
+                         + MINVM_PAGE_SIZE - 1) >> MINVM_PAGE_SHIFT;
+    
+    snapshot->pages = (uint8_t**)calloc(page_count, sizeof(uint8_t*));
+    
+    if (snapshot->pages == NULL)
+    {
+        return false;
+    }
+    
+    for (size_t i = 0; i < page_count; ++i)
+    {
+        if (vm->pages[i] == NULL)
+        {
+            continue;
+        }
+        
+        snapshot->pages[i] = (uint8_t*)malloc(MINVM_PAGE_SIZE);
+        
+        if (snapshot->pages[i] == NULL)
+        {
+            FreeVMSnapshot(snapshot);
+            return false;
+        }
+        
+        memcpy(snapshot->pages[i], vm->pages[i], MINVM_PAGE_SIZE);
+    }
+#else
+    snapshot->memory = (uint8_t*)malloc(vm->memory_size);
+    
+    if (snapshot->memory == NULL)
+    {
+        return false;
+    }
+    
+    CopyVMMemory(vm, snapshot->memory, vm->memory);
+#endif
+    
+    if (vm->quick_code != NULL)
+    {
+        snapshot->quick_code = (uint8_t*)malloc(vm->memory_size);
+        
+        if (snapshot->quick_code == NULL)
+        {
+            FreeVMSnapshot(snapshot);
+            return false;
+        }
+        
+        memcpy(snapshot->quick_code, vm->quick_code, vm->memory_size);
+    }
+    
+    snapshot->mark = NewDirtyMark();
+    ResetDirtyPages(vm, snapshot->mark);
+    return true;
+}
+
+//把第 page 页的内存恢复成快照中的内容
+static void RestoreSnapshotPage(TOYVM* vm, const VM_SNAPSHOT* snapshot,
+                                uint64_t page)
+{
+#ifdef MINVM_PAGED_MEMORY
+    //快照中没有的页清零，已经分配的页留给下一次使用
+    if (snapshot->pages[page] == NULL)
+    {
+        if (vm->pages[page] != NULL)
+        {
+            memset(vm->pages[page], 0, MINVM_PAGE_SIZE);
+        }
+        
+        return;
+    }
+    
+    if (vm->pages[page] == NULL)
+    {
+        vm->pages[page] = (uint8_t*)malloc(MINVM_PAGE_SIZE);
+    }
+    
+    if (vm->pages[page] == NULL)
+    {
+        vm->out_of_memory = true;
+        return;
+    }
+    
+    memcpy(vm->pages[page], snapshot->pages[page], MINVM_PAGE_SIZE);
+#else
+    size_t offset = (size_t) page * MINVM_DIRTY_PAGE_SIZE;
+    memcpy(vm->memory + offset, snapshot->memory + offset,
+           GetDirtyPageSize(vm, page));
+#endif
+}
+
+void RestoreVMSnapshot(TOYVM* vm, const VM_SNAPSHOT* snapshot)
+{
+#ifdef MINVM_PAGED_MEMORY
+    //恢复时分配不到的页由 RestoreSnapshotPage 重新记下
+    vm->out_of_memory = false;
+    
+#endif
+    if (vm->dirty_mark == snapshot->mark && snapshot->mark != DIRTY_MARK_NONE
+        && (snapshot->quick_code == NULL || vm->quick_code != NULL))
+    {
+        //上次清空位图时内存就是这个快照，只需要拷回之后写过的页
+        for (uint64_t page = NextDirtyVMPage(vm, 0);
+             page != UINT64_MAX;
+             page = NextDirtyVMPage(vm, page + 1))
+        {
+            size_t offset = (size_t) page * MINVM_DIRTY_PAGE_SIZE;
+            size_t size   = GetDirtyPageSize(vm, page);
+            
+            RestoreSnapshotPage(vm, snapshot, page);
+            
+            if (snapshot->quick_code != NULL)
+            {
+                memcpy(vm->quick_code + offset,
+                       snapshot->quick_code + offset,
+                       size);
+            }
+            else if (vm->quick_code != NULL)
+            {
+                memset(vm->quick_code + offset, QUICK_NONE, size);
+            }
+        }
+    }
+    else
+    {
+#ifdef MINVM_PAGED_MEMORY
+        for (uint64_t page = 0; page < GetDirtyPageCount(vm); ++page)
+        {
+            RestoreSnapshotPage(vm, snapshot, page);
+        }
+#else
+        CopyVMMemory(vm, vm->memory, snapshot->memory);
+#endif
+        
+        //恢复快照时的加速表；快照没有加速表时清空，运行期间的记录可能已经过期
+        if (snapshot->quick_code != NULL && vm->quick_code == NULL)
+        {
+            vm->quick_code = (uint8_t*)malloc(vm->memory_size);
+        }
+        
+        if (snapshot->quick_code != NULL && vm->quick_code != NULL)
+        {
+            memcpy(vm->quick_code, snapshot->quick_code, vm->memory_size);
+        }
+        else if (vm->quick_code != NULL)
+        {
+            memset(vm->quick_code, QUICK_NONE, vm->memory_size);
+        }
+    }
+    
+#ifdef MINVM_PAGED_MEMORY
+    for (size_t i = 0; i < MINVM_TLB_SIZE; ++i)
+    {
+        vm->tlb[i].page = (vm_unsigned_address) -1;
+        vm->tlb[i].data = NULL;
+    }
+#endif
+    ResetDirtyPages(vm, snapshot->mark);
+    vm->cpu  = snapshot->cpu;
+    vm->fuel = snapshot->fuel;
+}
+
+void FreeVMSnapshot(VM_SNAPSHOT* snapshot)
+{
+#ifdef MINVM_PAGED_MEMORY
+    size_t page_count = ((vm_unsigned_address) snapshot->memory_size
+                         + MINVM_PAGE_SIZE - 1) >> MINVM_PAGE_SHIFT;
+    
+    for (size_t i = 0; snapshot->pages != NULL && i < page_count; ++i)
+    {
+        free(snapshot->pages[i]);
+    }
+    
+    free(snapshot->pages);
+    snapshot->pages = NULL;
+#endif
+    free(snapshot->memory);
+    free(snapshot->quick_code);
+    snapshot->memory     = NULL;
+    snapshot->quick_code = NULL;
+}
+
+/*******************************************************************************
+* 检查点文件：一个 checkpoint_header，后面是 page_count 个全零以外的页，每页先写 *
+* 页号（uint64_t），再写页的内容；最后一页在内存末尾处可能不满一页。与快照一样， *
+* 所有数值按宿主机的字节序保存，检查点只能在同一种宿主机上恢复。加速表不保存，  *
+* 恢复后由运行中的虚拟机重新建立。                                             *
+*                                                                              *
+* 之后的检查点只把上一个检查点以来写过的页作为增量记录追加在后面：一个         *
+* checkpoint_delta，后面是它的 page_count 页，其中全零的页只写页号并标上        *
+* CHECKPOINT_ZERO_PAGE。增量记录完整写入之后才改写文件头中的 end，所以 end 之后 *
+* 的内容一律忽略，追加到一半失败的记录不会破坏上一个检查点。增量记录使文件超过 *
+* 完整检查点的两倍大时，重新写一个完整的检查点。                               *
+*******************************************************************************/
+#define CHECKPOINT_MAGIC 0x4b4d564du /* "MVMK" */
+#define CHECKPOINT_PAGE_SIZE MINVM_DIRTY_PAGE_SIZE
+#define CHECKPOINT_ZERO_PAGE (UINT64_C(1) << 63)
+
+typedef struct checkpoint_header {
+    uint32_t magic;
+    uint32_t page_size;
+    uint64_t memory_size;
+    uint64_t stack_limit;
+    uint64_t fuel;
+    uint64_t page_count;
+    VM_CPU   cpu;
+    uint64_t mark; /* 最后写入这个文件的虚拟机此后的 dirty_mark */
+    uint64_t end;  /* 最后一条完整的增量记录之后的文件偏移       */
+} checkpoint_header;
+
+typedef struct checkpoint_delta {
+    uint64_t fuel;
+    uint64_t page_count;
+    VM_CPU   cpu;
+} checkpoint_delta;
+
+//第 page 页是否落在保护页上；保护页不可访问，不保存也不恢复
+static bool IsGuardCheckpointPage(TOYVM* vm, uint64_t page)
+{
+#ifdef MINVM_GUARD_PAGE
+    uint64_t offset = page * CHECKPOINT_PAGE_SIZE;
+    return offset >= (uint64_t) GetGuardPage(vm)
+        && offset < (uint64_t) vm->stack_limit;
+#else
+    return false;
+#endif
+}
+
+//第 page 页在宿主机上的地址；没有分配的页和保护页返回 NULL，它们都是全零的
+static const uint8_t* GetCheckpointPage(TOYVM* vm, uint64_t page)
+{
+#ifdef MINVM_PAGED_MEMORY
+    return vm->pages[page];
+#else
+    return IsGuardCheckpointPage(vm, page)
+         ? NULL
+         : vm->memory + page * CHECKPOINT_PAGE_SIZE;
+#endif
+}
+
+//写入第 page 页的记录；写入出错时由调用者用 ferror 检查
+static void WriteCheckpointPage(TOYVM* vm, FILE* file, uint64_t page)
+{
+    const uint8_t* data = GetCheckpointPage(vm, page);
+    size_t size = GetDirtyPageSize(vm, page);
+    
+    if (data == NULL || IsZeroPage(data, size))
+    {
+        uint64_t record = page | CHECKPOINT_ZERO_PAGE;
+        fwrite(&record, sizeof(record), 1, file);
+        return;
+    }
+    
+    fwrite(&page, sizeof(page), 1, file);
+    fwrite(data, 1, size, file);
+}
+
+//把全零以外的页写入文件，返回写入的页数
+static uint64_t WriteCheckpointPages(TOYVM* vm, FILE* file)
+{
+    uint64_t page_count = 0;
+    
+    for (uint64_t page = 0; page < GetDirtyPageCount(vm); ++page)
+    {
+        const uint8_t* data = GetCheckpointPage(vm, page);
+        
+        if (data == NULL || IsZeroPage(data, GetDirtyPageSize(vm, page)))
+        {
+            continue;
+        }
+        
+        WriteCheckpointPage(vm, file, page);
+        page_count++;
+    }
+    
+    return page_count;
+}
+
+//一条 header_size 字节的头加上 page_count 页最多占多少字节
+static uint64_t GetCheckpointSize(size_t header_size, uint64_t page_count)
+{
+    return header_size + page_count * (sizeof(uint64_t) + CHECKPOINT_PAGE_SIZE);
+}
+
+//写一个完整的检查点
+static bool WriteCheckpoint(TOYVM* vm, const char* path)
+{
+    //先写到临时文件，写完再改名覆盖，中途失败不会破坏上一个检查点
+    size_t length = strlen(path);
+    char* temporary_path = (char*)malloc(length + sizeof(".tmp"));
+    
+    if (temporary_path == NULL)
+    {
+        return false;
+    }
+    
+    memcpy(temporary_path, path, length);
+    memcpy(temporary_path + length, ".tmp", sizeof(".tmp"));
+    
+    FILE* file = fopen(temporary_path, "wb");
+    
+    if (file == NULL)
+    {
+        free(temporary_path);
+        return false;
+    }
+    
+    checkpoint_header header = {
+        .magic       = CHECKPOINT_MAGIC,
+        .page_size   = CHECKPOINT_PAGE_SIZE,
+        .memory_size = (uint64_t) vm->memory_size,
+        .stack_limit = (uint64_t) vm->stack_limit,
+        .fuel        = vm->fuel,
+        .cpu         = vm->cpu,
+        .mark        = NewDirtyMark(),
+    };
+    
+    //页数在写完所有的页之后才知道，最后回到文件头补上
+    fwrite(&header, sizeof(header), 1, file);
+    header.page_count = WriteCheckpointPages(vm, file);
+    header.end        = (uint64_t) ftell(file);
+    
+    bool written = fseek(file, 0L, SEEK_SET) == 0
+                && fwrite(&header, sizeof(header), 1, file) == 1
+                && !ferror(file);
+    
+    written = fclose(file) == 0 && written
+           && rename(temporary_path, path) == 0;
+    
+    if (written)
+    {
+        ResetDirtyPages(vm, header.mark);
+    }
+    else
+    {
+        remove(temporary_path);
+    }
+    
+    free(temporary_path);
+    return written;
+}
+
+/*******************************************************************************
+* 文件中的检查点就是这台虚拟机上次清空位图时的状态时，把之后写过的页作为一条   *
+* 增量记录追加到文件中。文件不是这台虚拟机写的、追加后会太大或者写入失败时返回 *
+* false，由调用者改写完整的检查点。                                            *
+*******************************************************************************/
+static bool AppendCheckpoint(TOYVM* vm, const char* path)
+{
+    FILE* file = fopen(path, "r+b");
+    checkpoint_header header;
+    
+    if (file == NULL)
+    {
+        return false;
+    }
+    
+    uint64_t page_count = 0;
+    
+    for (uint64_t page = NextDirtyVMPage(vm, 0);
+         page != UINT64_MAX;
+         page = NextDirtyVMPage(vm, page + 1))
+    {
+        page_count++;
+    }
+    
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != CHECKPOINT_MAGIC
+        || header.mark != vm->dirty_mark
+        || header.memory_size != (uint64_t) vm->memory_size
+        || header.stack_limit != (uint64_t) vm->stack_limit
+        || header.end + GetCheckpointSize(sizeof(checkpoint_delta), page_count)
+           > 2 * GetCheckpointSize(sizeof(checkpoint_header), header.page_count))
+    {
+        fclose(file);
+        return false;
+    }
+    
+    checkpoint_delta delta = {
+        .fuel       = vm->fuel,
+        .page_count = page_count,
+        .cpu        = vm->cpu,
+    };
+    
+    bool written = fseek(file, (long) header.end, SEEK_SET) == 0
+                && fwrite(&delta, sizeof(delta), 1, file) == 1;
+    
+    for (uint64_t page = NextDirtyVMPage(vm, 0);
+         written && page != UINT64_MAX;
+         page = NextDirtyVMPage(vm, page + 1))
+    {
+        WriteCheckpointPage(vm, file, page);
+    }
+    
+    header.mark = NewDirtyMark();
+    header.end  = (uint64_t) ftell(file);
+    
+    //增量记录完整写入之后才改写文件头，这一步就是提交
+    written = written
+           && fflush(file) == 0
+           && fseek(file, 0L, SEEK_SET) == 0
+           && fwrite(&header, sizeof(header), 1, file) == 1
+           && !ferror(file);
+    
+    written = fclose(file) == 0 && written;
+    
+    if (written)
+    {
+        ResetDirtyPages(vm, header.mark);
+    }
+    
+    return written;
+}
+
+bool CheckpointVM(TOYVM* vm, const char* path)
+{
+    return AppendCheckpoint(vm, path) || WriteCheckpoint(vm, path);
+}
+
+//读出一页的记录，直接读到虚拟机的内存中，不经过中间缓冲区
+static bool ReadCheckpointPage(TOYVM* vm, FILE* file)
+{
+    uint64_t record;
+    
+    if (fread(&record, sizeof(record), 1, file) != 1)
+    {
+        return false;
+    }
+    
+    uint64_t page = record & ~CHECKPOINT_ZERO_PAGE;
+    
+    if (page >= GetDirtyPageCount(vm) || IsGuardCheckpointPage(vm, page))
+    {
+        return false;
+    }
+    
+    uint8_t* data = GuestMemory(vm, page * CHECKPOINT_PAGE_SIZE);
+    size_t size = GetDirtyPageSize(vm, page);
+    
+    if ((record & CHECKPOINT_ZERO_PAGE) != 0)
+    {
+        memset(data, 0, size);
+        return true;
+    }
+    
+    return fread(data, 1, size, file) == size;
+}
+
+//检查点中的大小是否是这种内存模式下 InitializeVM 调整出来的大小
+static bool IsValidLayout(vm_address memory_size, vm_address stack_limit)
+{
+    if (stack_limit < 0 || stack_limit > memory_size
+        || stack_limit % sizeof(int32_t) != 0)
+    {
+        return false;
+    }
+    
+#if defined(MINVM_MASKED_MEMORY_SIZE)
+    return memory_size == MINVM_MASKED_MEMORY_SIZE;
+#elif defined(MINVM_MASKED_MEMORY)
+    return memory_size >= (vm_address) sizeof(int32_t)
+        && (memory_size & (memory_size - 1)) == 0;
+#elif defined(MINVM_GUARD_PAGE)
+    int32_t page_size = (int32_t) sysconf(_SC_PAGESIZE);
+    return stack_limit >= page_size
+        && stack_limit % page_size == 0
+        && memory_size % page_size == 0;
+#else
+    return memory_size % sizeof(int32_t) == 0;
+#endif
+}
+
+bool RestoreVM(TOYVM* vm, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    checkpoint_header header;
+    
+    if (file == NULL)
+    {
+        return false;
+    }
+    
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != CHECKPOINT_MAGIC
+        || header.page_size != CHECKPOINT_PAGE_SIZE
+        || header.stack_limit > header.memory_size
+        || (uint64_t) (vm_address) header.memory_size != header.memory_size)
+    {
+        fclose(file);
+        return false;
+    }
+    
+    if (!IsValidLayout((vm_address) header.memory_size,
+                       (vm_address) header.stack_limit))
+    {
+        fclose(file);
+        return false;
+    }
+    
+    if (!AllocateVM(vm,
+                    (vm_address) header.memory_size,
+                    (vm_address) header.stack_limit))
+    {
+        fclose(file);
+        return false;
+    }
+    
+    bool restored = true;
+    
+    for (uint64_t i = 0; restored && i < header.page_count; ++i)
+    {
+        restored = ReadCheckpointPage(vm, file);
+    }
+    
+    //依次应用到 end 为止的增量记录，最后一条记录中是最新的 CPU 和燃料
+    while (restored && (uint64_t) ftell(file) < header.end)
+    {
+        checkpoint_delta delta;
+        restored = fread(&delta, sizeof(delta), 1, file) == 1;
+        
+        for (uint64_t i = 0; restored && i < delta.page_count; ++i)
+        {
+            restored = ReadCheckpointPage(vm, file);
+        }
+        
+        header.cpu  = delta.cpu;
+        header.fuel = delta.fuel;
+    }
+    
+    restored = restored && (uint64_t) ftell(file) == header.end;
+    fclose(file);
+    
+    if (!restored)
+    {
+        FreeVM(vm);
+        return false;
+    }
+    
+    vm->cpu  = header.cpu;
+    vm->fuel = header.fuel;
+    ResetDirtyPages(vm, header.mark);
+    return true;
+}
+
+#ifdef __linux__
+/*******************************************************************************
+* 把 [data, data + size) 中驻留在内存里、内容全为零的宿主机页交还给内核，返回  *
+* 交还的字节数。Linux 上对私有匿名内存 MADV_DONTNEED 之后，读到的是内核共享的  *
+* 零页，写入时才重新分配，所以内容不变。没有驻留的页本来就不占内存，不去读它， *
+* 否则会把它映射进来。其余的页标为 MADV_MERGEABLE，内核开启了 KSM 时，不同虚拟 *
+* 机（包括别的进程中的）里内容相同的页会被合并成一个写时复制的页。             *
+*******************************************************************************/
+static size_t ReleaseHostPages(uint8_t* data, size_t size)
+{
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t) data + page_size - 1) & ~(page_size - 1);
+    uintptr_t end   = ((uintptr_t) data + size) & ~(page_size - 1);
+    
+    if (data == NULL || begin >= end)
+    {
+        return 0;
+    }
+    
+    size_t page_count = (end - begin) / page_size;
+    unsigned char* resident = (unsigned char*)malloc(page_count);
+    size_t released = 0;
+    
+    if (resident != NULL && mincore((void*) begin, end - begin, resident) == 0)
+    {
+        for (size_t i = 0; i < page_count; ++i)
+        {
+            uint8_t* page = (uint8_t*) (begin + i * page_size);
+            
+            if ((resident[i] & 1) != 0
+                && IsZeroPage(page, page_size)
+                && madvise(page, page_size, MADV_DONTNEED) == 0)
+            {
+                released += page_size;
+            }
+        }
+    }
+    
+#ifdef MADV_MERGEABLE
+    madvise((void*) begin, end - begin, MADV_MERGEABLE);
+#endif
+    free(resident);
+    return released;
+}
+#endif
+
+size_t ReleaseVMMemory(TOYVM* vm)
+{
+    size_t released = 0;
+    
+#if defined(MINVM_PAGED_MEMORY)
+    //全零的页直接释放，下次访问时重新分配
+    for (uint64_t page = 0; page < GetDirtyPageCount(vm); ++page)
+    {
+        if (vm->pages[page] != NULL
+            && IsZeroPage(vm->pages[page], MINVM_PAGE_SIZE))
+        {
+            free(vm->pages[page]);
+            vm->pages[page] = NULL;
+            released += MINVM_PAGE_SIZE;
+        }
+    }
+    
+    for (size_t i = 0; i < MINVM_TLB_SIZE; ++i)
+    {
+        vm->tlb[i].page = (vm_unsigned_address) -1;
+        vm->tlb[i].data = NULL;
+    }
+#elif defined(MINVM_GUARD_PAGE) && defined(__linux__)
+    //保护页不可读，跳过它
+    released += ReleaseHostPages(vm->memory, GetGuardPage(vm));
+    released += ReleaseHostPages(vm->memory + vm->stack_limit,
+                                 vm->memory_size - vm->stack_limit);
+#elif defined(__linux__)
+    released += ReleaseHostPages(vm->memory, vm->memory_size);
+#endif
+    
+#ifdef __linux__
+    //QUICK_NONE 为零，重置过的虚拟机的加速表也是全零的
+    released += ReleaseHostPages(vm->quick_code,
+                                 vm->quick_code != NULL ? vm->memory_size : 0);
+#endif
+    return released;
+}
+
+#ifdef MINVM_PROFILE
+static const char* const opcode_names[OPCODE_MAP_SIZE] = {
+    [ADD]  = "ADD",  [NEG] = "NEG", [MUL] = "MUL", [DIV] = "DIV",
+    [MOD]  = "MOD",
+    [CMP]  = "CMP",  [JA]  = "JA",  [JE]  = "JE",  [JB]  = "JB",
+    [JMP]  = "JMP",  [LOOP] = "LOOP",
+    [CALL] = "CALL", [RET] = "RET",
+    [LOAD] = "LOAD", [STORE] = "STORE", [CONST] = "CONST",
+    [RLOAD] = "RLOAD", [RSTORE] = "RSTORE",
+    [LOADW] = "LOADW", [STOREW] = "STOREW",
+    [HALT] = "HALT", [INT] = "INT", [NOP] = "NOP",
+    [PUSH] = "PUSH", [PUSH_ALL] = "PUSH_ALL", [POP] = "POP",
+    [POP_ALL] = "POP_ALL", [LSP] = "LSP",
+};
+
+//记录一条即将执行的指令，并统计它与上一条执行的指令组成的指令对
+static void RecordOpcode(TOYVM* vm, uint8_t opcode)
+{
+    if (vm->previous_opcode != 0)
+    {
+        vm->opcode_pair_counts[vm->previous_opcode * OPCODE_MAP_SIZE
+                               + opcode]++;
+    }
+    
+    vm->previous_opcode = opcode;
+}
+
+typedef struct opcode_pair_count {
+    uint64_t count;
+    uint8_t  first;
+    uint8_t  second;
+} opcode_pair_count;
+
+static int CompareOpcodePairCounts(const void* a, const void* b)
+{
+    uint64_t count_a = ((const opcode_pair_count*) a)->count;
+    uint64_t count_b = ((const opcode_pair_count*) b)->count;
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+void PrintProfile(TOYVM* vm, size_t top)
+{
+    opcode_pair_count* pairs =
+        malloc(sizeof(opcode_pair_count) * OPCODE_MAP_SIZE * OPCODE_MAP_SIZE);
+    size_t n_pairs = 0;
+    
+    for (size_t i = 0; i < OPCODE_MAP_SIZE * OPCODE_MAP_SIZE; ++i)
+    {
+        if (vm->opcode_pair_counts[i] != 0)
+        {
+            pairs[n_pairs].count  = vm->opcode_pair_counts[i];
+            pairs[n_pairs].first  = (uint8_t)(i / OPCODE_MAP_SIZE);
+            pairs[n_pairs].second = (uint8_t)(i % OPCODE_MAP_SIZE);
+            ++n_pairs;
+        }
+    }
+    
+    qsort(pairs, n_pairs, sizeof(opcode_pair_count), CompareOpcodePairCounts);
+    
+    for (size_t i = 0; i < n_pairs && i < top; ++i)
+    {
+        const char* first  = opcode_names[pairs[i].first];
+        const char* second = opcode_names[pairs[i].second];
+        printf("%llu %s %s\n",
+               (unsigned long long) pairs[i].count,
+               first  ? first  : "?",
+               second ? second : "?");
+    }
+    
+    free(pairs);
+}
+#endif
+
+#ifdef MINVM_PAGED_MEMORY
+//有页没能分配时停在 program_counter 上的指令上并报告 BAD_ACCESS：它访问的内存
+//落到了 void_page 上，不是客户机的数据
+static bool StopOnPageFailure(TOYVM* vm, vm_address program_counter)
+{
+    if (MINVM_UNLIKELY(vm->out_of_memory))
+    {
+        vm->cpu.program_counter   = program_counter;
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    return false;
+}
+#endif
+
+#ifdef MINVM_GUARD_PAGE
+//保护页上的错误用 siglongjmp 跳过了解释器的返回，RunVM 用这两个值补扣出错之前
+//执行的指令的燃料：正在运行的解释器开始时的预算，和当前这条指令之前剩下的预算
+static _Thread_local uint64_t guarded_budget;
+static _Thread_local uint64_t guarded_remaining;
+#endif
+
+/*******************************************************************************
+* 普通解释器：直接按内存中的操作码分派，每条指令都做完整的检查。最多执行        *
+* '*budget' 条指令，并从中减去实际执行的条数（使虚拟机停机的那条指令不计在内）。 *
+* 虚拟机停机时返回 true，预算用完时返回 false。                                 *
+*******************************************************************************/
+static bool RunInterpreter(TOYVM* vm, uint64_t* budget)
+{
+#ifdef MINVM_PAGED_MEMORY
+    if (StopOnPageFailure(vm, GetProgramCounter(vm)))
+    {
+        return true;
+    }
+    
+#endif
+#ifdef MINVM_GUARD_PAGE
+    guarded_budget = *budget;
+#endif
+    for (uint64_t remaining = *budget; remaining != 0; --remaining)
+    {
+        vm_address program_counter = GetProgramCounter(vm);
+#ifdef MINVM_GUARD_PAGE
+        guarded_remaining = remaining;
+#endif
+        
+        /* One unsigned compare also rejects negative program counters. */
+        if (MINVM_UNLIKELY((vm_unsigned_address) program_counter >=
+                           (vm_unsigned_address) vm->memory_size))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            *budget = remaining;
+            return true;
+        }
+        
+        uint8_t opcode = ReadByte(vm, program_counter);
+#ifdef MINVM_PROFILE
+        RecordOpcode(vm, opcode);
+#endif
+        bool (*opcode_exec)(TOYVM*) = instructions[opcode].execute;
+        
+        if (MINVM_UNLIKELY(opcode_exec(vm)))
+        {
+            *budget = remaining;
+            return true;
+        }
+#ifdef MINVM_PAGED_MEMORY
+        
+        if (StopOnPageFailure(vm, program_counter))
+        {
+            *budget = remaining;
+            return true;
+        }
+#endif
+    }
+    
+    *budget = 0;
+    return false;
+}
+
+/*******************************************************************************
+* 加速解释器：按 quick_code 分派，见 ExecuteAndQuicken；预算的含义同上。合并的 *
+* 指令对算作两条指令：预算只剩一条时只执行其中的前一条，使两种解释器在同样的预 *
+* 算下停在同一个位置。                                                         *
+*******************************************************************************/
+static bool RunQuickened(TOYVM* vm, uint64_t* budget)
+{
+#ifdef MINVM_PAGED_MEMORY
+    if (StopOnPageFailure(vm, GetProgramCounter(vm)))
+    {
+        return true;
+    }
+    
+#endif
+#ifdef MINVM_GUARD_PAGE
+    guarded_budget = *budget;
+#endif
+    for (uint64_t remaining = *budget; remaining != 0; --remaining)
+    {
+        vm_address program_counter = GetProgramCounter(vm);
+#ifdef MINVM_GUARD_PAGE
+        guarded_remaining = remaining;
+#endif
+        
+        if (MINVM_UNLIKELY((vm_unsigned_address) program_counter >=
+                           (vm_unsigned_address) vm->memory_size))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            *budget = remaining;
+            return true;
+        }
+        
+#ifdef MINVM_PROFILE
+        RecordOpcode(vm, ReadByte(vm, program_counter));
+#endif
+        uint8_t quick_opcode = vm->quick_code[program_counter];
+        
+        if (quick_opcode >= QUICK_CMP_JA)
+        {
+            if (MINVM_UNLIKELY(remaining == 1))
+            {
+                quick_opcode = quick_opcode == QUICK_CONST_ADD ? QUICK_CONST
+                                                               : QUICK_CMP;
+            }
+            else
+            {
+                --remaining;
+            }
+        }
+        
+        bool (*opcode_exec)(TOYVM*) = quick_instructions[quick_opcode].execute;
+        
+        if (MINVM_UNLIKELY(opcode_exec(vm)))
+        {
+            *budget = remaining;
+            return true;
+        }
+#ifdef MINVM_PAGED_MEMORY
+        
+        if (StopOnPageFailure(vm, program_counter))
+        {
+            *budget = remaining;
+            return true;
+        }
+#endif
+    }
+    
+    *budget = 0;
+    return false;
+}
+
+/*******************************************************************************
+* ENGINE_AUTO 下先用普通解释器执行的指令条数。切换到加速解释器的代价是分配一张  *
+* 与内存等长的加速表，并在每条指令第一次执行时校验一次，所以内存越大，预热预算  *
+* 越多：一个已经执行了这么多指令的程序，通常还会再执行至少同样多的指令。        *
+*******************************************************************************/
+static uint64_t GetWarmUpBudget(TOYVM* vm)
+{
+    uint64_t budget = (uint64_t) vm->memory_size / 16;
+    return budget < 1024 ? 1024 : budget;
+}
+
+//按 vm->engine 运行，最多消耗 vm->fuel 条指令
+static void RunEngine(TOYVM* vm)
+{
+    switch (vm->engine)
+    {
+        case ENGINE_INTERPRETER:
+            RunInterpreter(vm, &vm->fuel);
+            return;
+            
+        case ENGINE_AUTO:
+            if (vm->quick_code == NULL)
+            {
+                uint64_t warm_up = GetWarmUpBudget(vm);
+                uint64_t budget  = warm_up < vm->fuel ? warm_up : vm->fuel;
+                uint64_t left    = budget;
+                bool     halted  = RunInterpreter(vm, &left);
+                
+                vm->fuel -= budget - left;
+                
+                if (halted || vm->fuel == 0)
+                {
+                    return;
+                }
+            }
+            
+            break;
+    }
+    
+    if (vm->quick_code == NULL)
+    {
+        vm->quick_code = (uint8_t*)calloc(vm->memory_size, sizeof(uint8_t));
+        
+        if (vm->quick_code == NULL)
         {
-            vm->cpu.status.BAD_INSTRUCTION = 1;
+            RunInterpreter(vm, &vm->fuel);
             return;
         }
+    }
+    
+    RunQuickened(vm, &vm->fuel);
+}
+
+#ifdef MINVM_GUARD_PAGE
+/*******************************************************************************
+* 保护页模式下，压栈越过 stack_limit 会写到保护页上并触发 SIGSEGV。信号处理函数 *
+* 检查出错地址是否落在当前线程正在运行的虚拟机的保护页内：是则跳回 RunVM，否则  *
+* 交给原来的处理方式。指令执行函数都是先访问内存、再修改栈指针和程序计数器，所 *
+* 以跳回时 CPU 状态仍停在出错的那条指令上。                                    *
+*******************************************************************************/
+static _Thread_local TOYVM*     guarded_vm;
+static _Thread_local sigjmp_buf guard_page_fault;
+static struct sigaction         previous_sigsegv_action;
+static int32_t                  guard_page_size;
+
+static void HandleGuardPageFault(int signal_number,
+                                 siginfo_t* info,
+                                 void* context)
+{
+    TOYVM* vm = guarded_vm;
+    
+    if (vm != NULL)
+    {
+        uint8_t* guard_page = vm->memory + vm->stack_limit - guard_page_size;
+        uint8_t* address    = (uint8_t*) info->si_addr;
+        
+        if (address >= guard_page && address < guard_page + guard_page_size)
+        {
+            siglongjmp(guard_page_fault, 1);
+        }
+    }
+    
+    if (previous_sigsegv_action.sa_flags & SA_SIGINFO)
+    {
+        previous_sigsegv_action.sa_sigaction(signal_number, info, context);
+    }
+    else if (previous_sigsegv_action.sa_handler != SIG_DFL
+             && previous_sigsegv_action.sa_handler != SIG_IGN)
+    {
+        previous_sigsegv_action.sa_handler(signal_number);
+    }
+    else
+    {
+        //恢复默认处理，返回后出错的指令会再次执行并按默认方式终止进程
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+//只安装一次，由 RunVM 通过 pthread_once 调用，多个线程同时运行虚拟机也是安全的
+static void InstallGuardPageHandler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = HandleGuardPageFault;
+    action.sa_flags     = SA_SIGINFO;
+    
+    guard_page_size = (int32_t) sysconf(_SC_PAGESIZE);
+    sigaction(SIGSEGV, &action, &previous_sigsegv_action);
+}
+
+void RunVM(TOYVM* vm)
+{
+    static pthread_once_t guard_page_handler_once = PTHREAD_ONCE_INIT;
+    
+    pthread_once(&guard_page_handler_once, InstallGuardPageHandler);
+    guarded_vm = vm;
+    
+    if (sigsetjmp(guard_page_fault, 1))
+    {
+        guarded_vm = NULL;
+        
+        //出错的那条指令与其他使虚拟机停机的指令一样不计在内
+        vm->fuel -= guarded_budget - guarded_remaining;
+        
+        //只有压栈的指令会越过栈底写到保护页上，其他指令访问保护页属于非法访问
+        switch (vm->memory[GetProgramCounter(vm)])
+        {
+            case PUSH:
+            case PUSH_ALL:
+            case CALL:
+                vm->cpu.status.STACK_OVERFLOW = 1;
+                break;
+                
+            default:
+                vm->cpu.status.BAD_ACCESS = 1;
+                break;
+        }
+        
+        return;
+    }
+    
+    RunEngine(vm);
+    guarded_vm = NULL;
+}
+#else
+void RunVM(TOYVM* vm)
+{
+    RunEngine(vm);
+}
+#endif
+
+#if defined(MINVM_GUARD_PAGE) || defined(MINVM_PROFILE) \
+    || defined(MINVM_COVERAGE)
+//保护页的错误处理、逐条指令的统计和覆盖率记录都只针对单台虚拟机，这些模式下
+//逐台运行
+void RunVMLanes(TOYVM* vms[], size_t count, size_t code_size)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        RunVM(vms[i]);
+    }
+}
+#else
+/*******************************************************************************
+* 多台虚拟机的同步（lockstep）执行。执行同一程序的 MINVM_LANES 台虚拟机的寄存器 *
+* 和比较标志位按“结构体数组”的方式并排存放，所有虚拟机停在同一条指令上时，这   *
+* 条指令只取指、校验一次，再用一个对所有通道的循环执行，编译器可以把这些循环向 *
+* 量化。条件跳转使各台虚拟机分道扬镳后，逐台单步执行程序计数器最小的虚拟机，   *
+* 直到它们在汇合点重新停在同一条指令上，再回到同步执行。                       *
+*******************************************************************************/
+typedef struct lane_state {
+    int32_t    registers[N_REGISTERS][MINVM_LANES];
+    vm_address program_counter[MINVM_LANES];
+    uint8_t    above[MINVM_LANES];
+    uint8_t    equal[MINVM_LANES];
+    uint8_t    below[MINVM_LANES];
+    TOYVM*     vms[MINVM_LANES];
+    bool       active[MINVM_LANES]; /* Not yet halted, faulted or out of fuel. */
+    size_t     n_lanes;
+    vm_address code_size;           /* 0 once a machine wrote to the code.    */
+} lane_state;
+
+//一次字写入是否可能落到代码上。越界的地址在屏蔽、分页模式下会折回内存中，
+//所以只有完整落在代码之后、内存之内的写入才算安全
+static bool WritesCode(const lane_state* s, const TOYVM* vm,
+                       vm_address address)
+{
+    return (vm_unsigned_address) address < (vm_unsigned_address) s->code_size
+        || (vm_unsigned_address) address
+           > (vm_unsigned_address) vm->memory_size - 4;
+}
+
+//每个活动的通道要访问的地址是否都在它的内存之内；addresses 为 NULL 时所有
+//通道都访问 address。有越界的访问时不同步执行，由逐台执行报告 BAD_ACCESS
+static bool LaneAddressesFit(lane_state* s, const int32_t* addresses,
+                             int32_t address)
+{
+    for (size_t l = 0; l < s->n_lanes; ++l)
+    {
+        //与 ExecuteRload、ExecuteLoad 一样：寄存器中的地址按有符号数扩展，
+        //指令中的地址按无符号数扩展
+        vm_address lane_address = addresses != NULL
+                                ? (vm_address) addresses[l]
+                                : (vm_address) (uint32_t) address;
+        
+        if (s->active[l]
+            && !GuestAddressFitsInMemory(s->vms[l], lane_address))
+        {
+            return false;
+        }
+#ifdef MINVM_PAGED_MEMORY
+        
+        //要分配页的访问可能失败，交给逐台执行报告
+        if (s->active[l]
+            && !WordIsMapped(s->vms[l], (vm_unsigned_address) lane_address))
+        {
+            return false;
+        }
+#endif
+    }
+    
+    return true;
+}
+
+//把活动的虚拟机的状态读入并排存放的寄存器中
+static void GatherLanes(lane_state* s)
+{
+    for (size_t l = 0; l < s->n_lanes; ++l)
+    {
+        VM_CPU* cpu = &s->vms[l]->cpu;
+        
+        if (!s->active[l])
+        {
+            continue;
+        }
+        
+        for (int r = 0; r < N_REGISTERS; ++r)
+        {
+            s->registers[r][l] = cpu->registers[r];
+        }
+        
+        s->program_counter[l] = cpu->program_counter;
+        s->above[l] = cpu->status.COMPARISON_ABOVE;
+        s->equal[l] = cpu->status.COMPARISON_EQUAL;
+        s->below[l] = cpu->status.COMPARISON_BELOW;
+    }
+}
+
+/*******************************************************************************
+* 把并排存放的状态写回活动的虚拟机，它们都执行了 executed 条指令。不活动的通道  *
+* 在同步执行时也参与了计算，它们的结果不写回。                                 *
+*******************************************************************************/
+static void ScatterLanes(lane_state* s, uint64_t executed)
+{
+    for (size_t l = 0; l < s->n_lanes; ++l)
+    {
+        VM_CPU* cpu = &s->vms[l]->cpu;
+        
+        if (!s->active[l])
+        {
+            continue;
+        }
+        
+        for (int r = 0; r < N_REGISTERS; ++r)
+        {
+            cpu->registers[r] = s->registers[r][l];
+        }
+        
+        cpu->program_counter         = s->program_counter[l];
+        cpu->status.COMPARISON_ABOVE = s->above[l];
+        cpu->status.COMPARISON_EQUAL = s->equal[l];
+        cpu->status.COMPARISON_BELOW = s->below[l];
+        s->vms[l]->fuel -= executed;
+    }
+}
+
+//所有活动的通道是否停在同一条指令上
+static bool LanesConverged(const lane_state* s)
+{
+    const vm_address* first = NULL;
+    
+    for (size_t l = 0; l < s->n_lanes; ++l)
+    {
+        if (!s->active[l])
+        {
+            continue;
+        }
+        
+        if (first != NULL && s->program_counter[l] != *first)
+        {
+            return false;
+        }
+        
+        first = &s->program_counter[l];
+    }
+    
+    return true;
+}
+
+/*******************************************************************************
+* 从 program_counter 开始同步执行，最多 budget 条指令，返回执行的条数。遇到不能 *
+* 同步执行的指令（包括操作数无效、会出错的指令）时在它之前停下，由逐台执行重现  *
+* 它的效果；条件跳转使各通道分开时在它之后停下；遇到 HALT 时在它之上停下并设置  *
+* *halted。返回时各通道的程序计数器在 s->program_counter 中。                   *
+*******************************************************************************/
+static uint64_t RunLockstep(lane_state* s, vm_address program_counter,
+                            uint64_t budget, bool* halted)
+{
+    TOYVM* code = NULL;
+    uint64_t executed = 0;
+    
+    //代码在各台虚拟机中都一样，从任意一台活动的虚拟机中取指
+    for (size_t l = 0; code == NULL; ++l)
+    {
+        code = s->active[l] ? s->vms[l] : NULL;
+    }
+    
+    *halted = false;
+    
+    for (; executed < budget; ++executed)
+    {
+        //跳到代码之外（包括负地址）时不取指，由逐台执行报告 BAD_ACCESS
+        if ((vm_unsigned_address) program_counter
+            >= (vm_unsigned_address) s->code_size)
+        {
+            break;
+        }
+        
+        uint8_t opcode = ReadByte(code, program_counter);
+        vm_address length = (vm_address) instructions[opcode].size;
+        
+        if (length == 0 || program_counter + length > s->code_size)
+        {
+            break;
+        }
+        
+        uint8_t i = length > 1 ? ReadByte(code, program_counter + 1) : 0;
+        uint8_t j = length > 2 ? ReadByte(code, program_counter + 2) : 0;
+        bool    taken[MINVM_LANES];
+        int32_t operand;
+        
+        switch (opcode)
+        {
+            case NOP:
+                break;
+            
+            case HALT:
+                *halted = true;
+                goto stop;
+            
+            //用无符号数运算，溢出时回绕，与逐台执行的结果相同
+            case ADD:
+                if (!IsValidRegisterIndex(i) || !IsValidRegisterIndex(j))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->registers[j][l] = (int32_t) ((uint32_t) s->registers[j][l]
+                                                  + (uint32_t) s->registers[i][l]);
+                }
+            
+                break;
+            
+            case MUL:
+                if (!IsValidRegisterIndex(i) || !IsValidRegisterIndex(j))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->registers[j][l] = (int32_t) ((uint32_t) s->registers[j][l]
+                                                  * (uint32_t) s->registers[i][l]);
+                }
+            
+                break;
+            
+            case NEG:
+                if (!IsValidRegisterIndex(i))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->registers[i][l] =
+                        (int32_t) (0u - (uint32_t) s->registers[i][l]);
+                }
+            
+                break;
+            
+            case CMP:
+                if (!IsValidRegisterIndex(i) || !IsValidRegisterIndex(j))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->above[l] = s->registers[i][l] >  s->registers[j][l];
+                    s->equal[l] = s->registers[i][l] == s->registers[j][l];
+                    s->below[l] = s->registers[i][l] <  s->registers[j][l];
+                }
+            
+                break;
+            
+            case CONST:
+                if (!IsValidRegisterIndex(i))
+                {
+                    goto stop;
+                }
+            
+                operand = ReadWord(code, program_counter + 2);
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->registers[i][l] = operand;
+                }
+            
+                break;
+            
+            //访存的指令逐个通道访问各自的内存
+            case LOAD:
+            case STORE:
+                if (!IsValidRegisterIndex(i))
+                {
+                    goto stop;
+                }
+            
+                operand = ReadWord(code, program_counter + 2);
+            
+                if (!LaneAddressesFit(s, NULL, operand))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < s->n_lanes; ++l)
+                {
+                    if (!s->active[l])
+                    {
+                        continue;
+                    }
+                
+                    if (opcode == LOAD)
+                    {
+                        s->registers[i][l] =
+                            ReadWord(s->vms[l], (uint32_t) operand);
+                    }
+                    else
+                    {
+                        WriteWord(s->vms[l], (uint32_t) operand,
+                                  s->registers[i][l]);
+                    
+                        //写到了代码上，以后各台虚拟机的代码可能不同
+                        if (WritesCode(s, s->vms[l], (uint32_t) operand))
+                        {
+                            s->code_size = 0;
+                        }
+                    }
+                }
+            
+                break;
+            
+            case RLOAD:
+            case RSTORE:
+                if (!IsValidRegisterIndex(i) || !IsValidRegisterIndex(j))
+                {
+                    goto stop;
+                }
+            
+                if (!LaneAddressesFit(s, opcode == RLOAD ? s->registers[i]
+                                                         : s->registers[j], 0))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < s->n_lanes; ++l)
+                {
+                    if (!s->active[l])
+                    {
+                        continue;
+                    }
+                
+                    if (opcode == RLOAD)
+                    {
+                        s->registers[j][l] =
+                            ReadWord(s->vms[l], s->registers[i][l]);
+                        continue;
+                    }
+                
+                    WriteWord(s->vms[l], s->registers[j][l],
+                              s->registers[i][l]);
+                
+                    if (WritesCode(s, s->vms[l], s->registers[j][l]))
+                    {
+                        s->code_size = 0;
+                    }
+                }
+            
+                break;
+            
+            case JMP:
+                program_counter = ReadWord(code, program_counter + 1);
+                continue;
+            
+            case LOOP:
+                if (!IsValidRegisterIndex(i))
+                {
+                    goto stop;
+                }
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->registers[i][l] =
+                        (int32_t) ((uint32_t) s->registers[i][l] - 1);
+                    taken[l] = s->registers[i][l] != 0;
+                }
+            
+                goto branch;
+            
+            case JA:
+            case JE:
+            case JB:
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    taken[l] = opcode == JA ? s->above[l]
+                             : opcode == JE ? s->equal[l]
+                             :                s->below[l];
+                }
+            
+            branch:
+                operand = ReadWord(code,
+                                   program_counter + (opcode == LOOP ? 2 : 1));
+            
+                for (size_t l = 0; l < MINVM_LANES; ++l)
+                {
+                    s->program_counter[l] = taken[l]
+                                          ? operand
+                                          : program_counter + length;
+                }
+            
+                if (!LanesConverged(s))
+                {
+                    return executed + 1;
+                }
+            
+                //各通道仍然一致，继续同步执行
+                for (size_t l = 0; l < s->n_lanes; ++l)
+                {
+                    if (s->active[l])
+                    {
+                        program_counter = s->program_counter[l];
+                    }
+                }
+            
+                continue;
+            
+            default:
+                goto stop;
+        }
+        
+        program_counter += length;
+    }
+    
+stop:
+    for (size_t l = 0; l < MINVM_LANES; ++l)
+    {
+        s->program_counter[l] = program_counter;
+    }
+    
+    return executed;
+}
+
+//逐台执行之前：这条指令是否可能写到代码上
+static bool MayWriteCode(const lane_state* s, TOYVM* vm)
+{
+    vm_address program_counter = vm->cpu.program_counter;
+    
+    //程序计数器越界时解释器会报错，不会写内存
+    if ((vm_unsigned_address) program_counter
+        >= (vm_unsigned_address) vm->memory_size)
+    {
+        return false;
+    }
+    
+    uint8_t opcode = ReadByte(vm, program_counter);
+    
+    if (opcode == STOREW)
+    {
+        return true;
+    }
+    
+    if ((opcode != STORE && opcode != RSTORE)
+        || !InstructionFitsInMemory(vm, opcode))
+    {
+        return false;
+    }
+    
+    if (opcode == STORE)
+    {
+        vm_address address = (uint32_t) ReadWord(vm, program_counter + 2);
+        return WritesCode(s, vm, address);
+    }
+    
+    uint8_t address_register_index = ReadByte(vm, program_counter + 2);
+    
+    return IsValidRegisterIndex(address_register_index)
+        && WritesCode(s, vm, vm->cpu.registers[address_register_index]);
+}
+
+//单步执行一台虚拟机，它停机、出错或燃料耗尽时不再活动
+static void StepLane(lane_state* s, size_t l)
+{
+    TOYVM* vm = s->vms[l];
+    uint64_t budget = 1;
+    
+    if (vm->fuel == 0)
+    {
+        s->active[l] = false;
+        return;
+    }
+    
+    if (s->code_size != 0 && MayWriteCode(s, vm))
+    {
+        s->code_size = 0;
+    }
     
-        bool (*opcode_exec)(TOYVM*) =
-        instructions[index].execute;
+    if (RunInterpreter(vm, &budget))
+    {
+        s->active[l] = false;
+    }
     
-        if (opcode_exec(vm))
+    vm->fuel -= 1 - budget;
+}
+
+/*******************************************************************************
+* 运行一组（最多 MINVM_LANES 台）虚拟机。所有活动的虚拟机停在同一条指令上时同步 *
+* 执行，否则单步执行程序计数器最小的那些虚拟机：条件跳转的两个分支通常都在汇合 *
+* 点之前，这样先走到汇合点的虚拟机会等待落后的虚拟机，在汇合点重新同步。        *
+*******************************************************************************/
+static void RunLanes(lane_state* s)
+{
+    while (true)
+    {
+        vm_address minimum = 0;
+        uint64_t budget = UINT64_MAX;
+        bool any = false;
+        bool converged = true;
+        
+        for (size_t l = 0; l < s->n_lanes; ++l)
+        {
+            TOYVM* vm = s->vms[l];
+            
+            if (!s->active[l])
+            {
+                continue;
+            }
+            
+            if (any && vm->cpu.program_counter != minimum)
+            {
+                converged = false;
+            }
+            
+            if (!any || vm->cpu.program_counter < minimum)
+            {
+                minimum = vm->cpu.program_counter;
+            }
+            
+            budget = vm->fuel < budget ? vm->fuel : budget;
+            any = true;
+        }
+        
+        if (!any)
         {
             return;
         }
+        
+        if (converged && budget != 0
+            && minimum >= 0 && minimum < s->code_size)
+        {
+            bool halted;
+            
+            GatherLanes(s);
+            
+            uint64_t executed = RunLockstep(s, minimum, budget, &halted);
+            
+            ScatterLanes(s, executed);
+            
+            //停机指令不计入执行的指令
+            if (halted)
+            {
+                for (size_t l = 0; l < s->n_lanes; ++l)
+                {
+                    s->active[l] = false;
+                }
+                
+                return;
+            }
+            
+            if (executed != 0)
+            {
+                continue;
+            }
+        }
+        
+        for (size_t l = 0; l < s->n_lanes; ++l)
+        {
+            if (s->active[l] && s->vms[l]->cpu.program_counter == minimum)
+            {
+                StepLane(s, l);
+            }
+        }
     }
 }
 
+void RunVMLanes(TOYVM* vms[], size_t count, size_t code_size)
+{
+    for (size_t first = 0; first < count; first += MINVM_LANES)
+    {
+        lane_state s;
+        memset(&s, 0, sizeof(s));
+        s.n_lanes   = count - first < MINVM_LANES ? count - first : MINVM_LANES;
+        s.code_size = (vm_address) code_size;
+        
+        for (size_t l = 0; l < s.n_lanes; ++l)
+        {
+            s.vms[l]    = vms[first + l];
+            s.active[l] = true;
+            
+            //栈上的写入不能碰到代码
+            if (s.code_size > s.vms[l]->stack_limit)
+            {
+                s.code_size = s.vms[l]->stack_limit;
+            }
+        }
+        
+        for (size_t l = s.n_lanes; l < MINVM_LANES; ++l)
+        {
+            s.active[l] = false;
+        }
+        
+        RunLanes(&s);
+    }
+}
+#endif
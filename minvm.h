@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -15,11 +16,12 @@ enum {
     MOD = 0x05,
     
     /* Conditionals */
-    CMP = 0x10,
-    JA  = 0x11,
-    JE  = 0x12,
-    JB  = 0x13,
-    JMP = 0x14,
+    CMP  = 0x10,
+    JA   = 0x11,
+    JE   = 0x12,
+    JB   = 0x13,
+    JMP  = 0x14,
+    LOOP = 0x15,
     
     /* Subroutines */
     CALL = 0x20,
@@ -31,6 +33,8 @@ enum {
     CONST  = 0x32,
     RLOAD  = 0x33,
     RSTORE = 0x34,
+    LOADW  = 0x35,
+    STOREW = 0x36,
     
     /* Auxiliary */
     HALT = 0x40,
@@ -54,16 +58,38 @@ enum {
     INTERRUPT_PRINT_INTEGER = 0x01,
     INTERRUPT_PRINT_STRING  = 0x02,
     
+    /* Engines */
+    ENGINE_AUTO        = 0x00,
+    ENGINE_INTERPRETER = 0x01,
+    ENGINE_QUICKENING  = 0x02,
+    
     /* Miscellaneous */
     N_REGISTERS = 4,
     
     OPCODE_MAP_SIZE = 256,
 };
 
+/*******************************************************************************
+* The type of guest addresses, the program counter, the stack pointer and the  *
+* memory size. It is 32 bits wide unless built with -DMINVM_WIDE_ADDRESS,      *
+* which makes it 64 bits wide and implies -DMINVM_PAGED_MEMORY so that a       *
+* large guest only pays for the pages it touches.                              *
+*******************************************************************************/
+#ifdef MINVM_WIDE_ADDRESS
+#ifndef MINVM_PAGED_MEMORY
+#define MINVM_PAGED_MEMORY
+#endif
+typedef int64_t  vm_address;
+typedef uint64_t vm_unsigned_address;
+#else
+typedef int32_t  vm_address;
+typedef uint32_t vm_unsigned_address;
+#endif
+
 typedef struct VM_CPU {
-    int32_t registers[N_REGISTERS];
-    int32_t program_counter;
-    int32_t stack_pointer;
+    int32_t    registers[N_REGISTERS];
+    vm_address program_counter;
+    vm_address stack_pointer;
     
     struct {
         uint8_t BAD_INSTRUCTION        : 1;
@@ -77,19 +103,142 @@ typedef struct VM_CPU {
     } status;
 } VM_CPU;
 
+#ifdef MINVM_PAGED_MEMORY
+#ifndef MINVM_PAGE_SHIFT
+#define MINVM_PAGE_SHIFT 12
+#endif
+
+#ifndef MINVM_TLB_SIZE
+#define MINVM_TLB_SIZE 16
+#endif
+
+#define MINVM_PAGE_SIZE (1u << MINVM_PAGE_SHIFT)
+
+typedef struct VM_TLB_ENTRY {
+    vm_unsigned_address page;
+    uint8_t*            data;
+} VM_TLB_ENTRY;
+#endif
+
+#ifdef MINVM_COVERAGE
+/*******************************************************************************
+* When built with -DMINVM_COVERAGE, a machine whose 'coverage_map' is set      *
+* records guest control flow the way AFL does: every jump, LOOP, CALL and RET *
+* (taken or not) hashes its own address and the address it went to into an    *
+* index and bumps the byte counter there. The map belongs to the caller, who   *
+* may point it at shared memory; it is never cleared or freed by the VM.       *
+* InitializeVM() leaves it NULL, which records nothing.                        *
+*******************************************************************************/
+#ifndef MINVM_COVERAGE_MAP_SIZE
+#define MINVM_COVERAGE_MAP_SIZE (1u << 16) /* Must be a power of two. */
+#endif
+#endif
+
+/*******************************************************************************
+* Every machine keeps a bitmap of the pages of MINVM_DIRTY_PAGE_SIZE bytes     *
+* (MINVM_PAGE_SIZE when built with -DMINVM_PAGED_MEMORY, 4 KiB otherwise)      *
+* written since the bitmap was last cleared, see IsVMPageDirty().              *
+*******************************************************************************/
+#ifdef MINVM_PAGED_MEMORY
+#define MINVM_DIRTY_PAGE_SIZE MINVM_PAGE_SIZE
+#else
+#define MINVM_DIRTY_PAGE_SIZE 4096u
+#endif
+
 typedef struct TOYVM {
-    uint8_t* memory;
-    int32_t  memory_size;
-    int32_t  stack_limit;
-    VM_CPU   cpu;
-    size_t   opcode_map[OPCODE_MAP_SIZE];
+    uint8_t*   memory;
+    uint8_t*   quick_code; /* Per-byte record of pre-validated instructions. */
+    int32_t    engine;     /* One of ENGINE_AUTO (default),                  *
+                            * ENGINE_INTERPRETER, ENGINE_QUICKENING.         */
+    vm_address memory_size;
+    vm_address stack_limit;
+    VM_CPU     cpu;
+    FILE*      output;     /* Where INT prints to; stdout by default.        */
+    uint64_t   fuel;       /* Instructions RunVM() may still execute.        */
+    uint64_t*  dirty_pages; /* One bit per page, set when it is written.     */
+    uint64_t   dirty_mark;  /* What the memory held when the bits were last  *
+                             * cleared; private to the VM.                   */
+#ifdef MINVM_PAGED_MEMORY
+    uint8_t**    pages;     /* Page table; pages are allocated on first touch. */
+    uint8_t*     void_page; /* Backs every access beyond 'memory_size'.       */
+    bool         out_of_memory; /* A page could not be allocated.          */
+    VM_TLB_ENTRY tlb[MINVM_TLB_SIZE];
+#endif
+#ifdef MINVM_PROFILE
+    uint64_t* opcode_pair_counts; /* [first * OPCODE_MAP_SIZE + second] */
+    uint8_t   previous_opcode;
+#endif
+#ifdef MINVM_COVERAGE
+    uint8_t*  coverage_map; /* Edge counters, see above; NULL records none. */
+#endif
 } TOYVM;
 
 /*******************************************************************************
 * Initializes the virtual machine with RAM memory of length 'memory_size' and  *
-* the stack fence at 'stack_limit'.
+* the stack fence at 'stack_limit'. Returns 'false' if the memory cannot be    *
+* allocated, or if 'memory_size' is too large to be adjusted as described      *
+* below; the machine is then zeroed, and FreeVM() on it does nothing.          *
+*                                                                              *
+* When built with -DMINVM_GUARD_PAGE (POSIX only), the memory is mapped with   *
+* mmap() and a PROT_NONE guard page is placed between the data and the stack:  *
+* the guard page starts at 'stack_limit' rounded up to a page, and            *
+* 'stack_limit' and 'memory_size' are moved up so the stack stays page aligned *
+* and at least as large as requested. Stack pushes are then not bounds         *
+* checked; RunVM() turns a fault on the guard page into STACK_OVERFLOW (or     *
+* BAD_ACCESS for non-stack instructions) with the program counter left on the  *
+* faulting instruction.                                                        *
+*                                                                              *
+* When built with -DMINVM_MASKED_MEMORY, 'memory_size' is rounded up to a      *
+* power of two (or fixed to MINVM_MASKED_MEMORY_SIZE when that is defined) and *
+* every guest address wraps around modulo 'memory_size' instead of being       *
+* checked.                                                                     *
+*                                                                              *
+* When built with -DMINVM_PAGED_MEMORY, 'memory' is NULL and guest memory is a *
+* page table of MINVM_PAGE_SIZE pages (4 KiB unless MINVM_PAGE_SHIFT says     *
+* otherwise) allocated on first touch, so a large, sparsely used address space *
+* costs only the pages the guest touches. Load programs with WriteVMMemory().  *
+* When a page cannot be allocated, RunVM() stops on the instruction that       *
+* touched it with BAD_ACCESS set, until ResetVM() or RestoreVMSnapshot().      *
+*                                                                              *
+* When built with -DMINVM_WIDE_ADDRESS, 'memory_size' may exceed 2 GiB. Only   *
+* LOADW and STOREW, whose address operand is 64 bits wide, and the stack can   *
+* reach beyond the first 4 GiB: jump and call targets, LOAD, STORE and the     *
+* register forms still take 32-bit addresses, and LSP yields the low 32 bits   *
+* of the stack pointer.                                                        *
+*******************************************************************************/
+bool InitializeVM(TOYVM* vm, vm_address memory_size, vm_address stack_limit);
+
+/*******************************************************************************
+* Returns the machine to the state InitializeVM() left it in (zeroed memory,   *
+* registers and flags, unlimited fuel), keeping its allocations, so that it    *
+* can run another program without paying for InitializeVM() again. 'engine'   *
+* and 'output' are kept as well. Only the pages written since the machine was  *
+* initialised or last reset are cleared, see IsVMPageDirty().                  *
+*******************************************************************************/
+void ResetVM(TOYVM* vm);
+
+/*******************************************************************************
+* Releases the memory of the machine.                                          *
 *******************************************************************************/
-void InitializeVM(TOYVM* vm, int32_t memory_size, int32_t stack_limit);
+void FreeVM(TOYVM* vm);
+
+/*******************************************************************************
+* Gives back to the host the memory an idle machine holds without needing it,  *
+* leaving what the guest sees unchanged, and returns the number of bytes       *
+* released. Meant for machines kept in a pool between runs, ideally after      *
+* ResetVM(), when nearly all of their memory is zeros.                         *
+*                                                                              *
+* With -DMINVM_PAGED_MEMORY the pages that are all zeros are freed, to be      *
+* allocated again on first touch. Otherwise, on Linux, the host pages of the   *
+* memory and of 'quick_code' that are resident and all zeros are released      *
+* with MADV_DONTNEED, so they read as the kernel's shared zero page until      *
+* written, and the rest are marked MADV_MERGEABLE, so that where KSM is        *
+* enabled the kernel merges pages that are the same in many machines (the      *
+* same program loaded into each of them, say) into one copy-on-write page.     *
+* Pages merged by KSM are not counted in the result. Elsewhere this does       *
+* nothing and returns 0.                                                       *
+*******************************************************************************/
+size_t ReleaseVMMemory(TOYVM* vm);
 
 /*******************************************************************************
 * Writes 'size' bytes to the memory of the machine. The write begins from the  *
@@ -97,21 +246,211 @@ void InitializeVM(TOYVM* vm, int32_t memory_size, int32_t stack_limit);
 *******************************************************************************/
 void WriteVMMemory(TOYVM* vm, uint8_t* mem, size_t size);
 
+/*******************************************************************************
+* Writes 'size' bytes to the memory of the machine, starting at 'address'.     *
+*******************************************************************************/
+void WriteVMMemoryAt(TOYVM* vm, vm_address address, const uint8_t* mem,
+                     size_t size);
+
+/*******************************************************************************
+* A program image: the program bytes together with the result of validating   *
+* every instruction in them for ENGINE_QUICKENING. An image is read-only once  *
+* created and can be loaded into any number of machines, from any thread, so   *
+* machines running the same program validate it only once.                     *
+*******************************************************************************/
+typedef struct VM_IMAGE {
+    uint8_t* code;
+    uint8_t* quick_code;
+    size_t   size;
+} VM_IMAGE;
+
+/*******************************************************************************
+* Copies the 'size' bytes at 'code' into 'image' and validates them. Returns   *
+* 'false' if out of memory.                                                    *
+*******************************************************************************/
+bool CreateVMImage(VM_IMAGE* image, const uint8_t* code, size_t size);
+
+/*******************************************************************************
+* Writes the program of 'image' to the beginning of the memory of the machine  *
+* and, unless 'vm->engine' is ENGINE_INTERPRETER, installs its validation      *
+* results so that the program runs quickened from its first instruction.       *
+*******************************************************************************/
+void LoadVMImage(TOYVM* vm, const VM_IMAGE* image);
+
+/*******************************************************************************
+* Releases the memory of the image.                                            *
+*******************************************************************************/
+void FreeVMImage(VM_IMAGE* image);
+
+/*******************************************************************************
+* A copy of the state of a machine: its CPU, fuel, memory and 'quick_code'     *
+* table. Restoring a snapshot costs a copy of the pages the machine wrote      *
+* since it was taken or last restored (the whole memory the first time it is   *
+* restored into another machine) instead of InitializeVM() and loading and     *
+* validating the program again, so a machine can run one program over many     *
+* inputs from the same starting state. A snapshot is read-only once taken and  *
+* can be restored into any number of machines, from any thread, as long as     *
+* they were initialised with the same sizes as the machine it was taken from.  *
+*******************************************************************************/
+typedef struct VM_SNAPSHOT {
+    VM_CPU     cpu;
+    uint64_t   fuel;
+    vm_address memory_size;
+    uint8_t*   memory;     /* NULL when built with -DMINVM_PAGED_MEMORY.      */
+    uint8_t*   quick_code; /* NULL if the machine had no 'quick_code' table.  */
+    uint64_t   mark;       /* Lets a machine restored from the snapshot copy  *
+                            * back only the pages it wrote since.             */
+#ifdef MINVM_PAGED_MEMORY
+    uint8_t**  pages;      /* Copies of the allocated pages, NULL for the     *
+                            * pages the machine had not touched.              */
+#endif
+} VM_SNAPSHOT;
+
+/*******************************************************************************
+* Takes a snapshot of the machine. Returns 'false' if out of memory.           *
+*******************************************************************************/
+bool SnapshotVM(TOYVM* vm, VM_SNAPSHOT* snapshot);
+
+/*******************************************************************************
+* Returns the machine to the state recorded in 'snapshot'. 'engine' and        *
+* 'output' are kept.                                                           *
+*******************************************************************************/
+void RestoreVMSnapshot(TOYVM* vm, const VM_SNAPSHOT* snapshot);
+
+/*******************************************************************************
+* Releases the memory of the snapshot.                                         *
+*******************************************************************************/
+void FreeVMSnapshot(VM_SNAPSHOT* snapshot);
+
+/*******************************************************************************
+* Writes a checkpoint of the machine to the file 'path': its CPU, fuel, memory *
+* size, stack limit and every memory page that is not all zeros, so that a     *
+* long run can be stopped and continued later, possibly in another process.  *
+* The file is written beside 'path' and renamed over it once complete, so a    *
+* checkpoint that fails half way leaves the previous one intact. 'quick_code'  *
+* is not saved. Returns 'false' if the file cannot be written.                 *
+*                                                                              *
+* When 'path' holds the last checkpoint this machine wrote or was restored     *
+* from, only the pages written since are appended to it, committed by          *
+* rewriting its header once they are complete; the file is written anew once   *
+* the appended pages would make it more than twice the size of a full one.     *
+*******************************************************************************/
+bool CheckpointVM(TOYVM* vm, const char* path);
+
+/*******************************************************************************
+* Initializes the machine from the checkpoint in the file 'path', which must   *
+* have been written by a build with the same memory mode, and leaves it ready  *
+* for RunVM() to continue where the checkpointed machine stopped. 'engine' and *
+* 'output' take their InitializeVM() defaults. Returns 'false', leaving the    *
+* machine uninitialised, if the file cannot be read or is not a checkpoint.    *
+*******************************************************************************/
+bool RestoreVM(TOYVM* vm, const char* path);
+
+/*******************************************************************************
+* Dirty page tracking. Every write through WriteWord(), WriteVMMemory() and    *
+* WriteVMMemoryAt(), which includes every guest store and push, sets the bit   *
+* of each page it touches, and so does quickening an instruction, which        *
+* changes 'quick_code'. Memory written directly through 'memory' is not        *
+* tracked. Pages are numbered from 0 at address 0.                             *
+*                                                                              *
+* ResetVM(), SnapshotVM(), RestoreVMSnapshot(), CheckpointVM() and RestoreVM() *
+* clear the bitmap and remember what the memory held at that point, so that    *
+* the next ResetVM(), RestoreVMSnapshot() of the same snapshot or              *
+* CheckpointVM() to the same file only has to touch the pages written since,   *
+* and costs time in proportion to what the guest changed rather than to the    *
+* size of its memory. A machine that uses more than one of them falls back to  *
+* touching every page whenever it switches, and so does every one of them      *
+* after the caller clears the bitmap with ClearVMDirtyPages().                 *
+*******************************************************************************/
+
+/*******************************************************************************
+* Returns 'true' if page 'page' was written since the bitmap was cleared.      *
+*******************************************************************************/
+bool IsVMPageDirty(const TOYVM* vm, uint64_t page);
+
+/*******************************************************************************
+* Returns the first dirty page numbered 'page' or higher, or UINT64_MAX if     *
+* there is none, so that the dirty pages can be visited with                   *
+*                                                                              *
+*     for (uint64_t page = NextDirtyVMPage(vm, 0);                             *
+*          page != UINT64_MAX;                                                 *
+*          page = NextDirtyVMPage(vm, page + 1))                               *
+*                                                                              *
+* skipping clean pages 64 at a time.                                           *
+*******************************************************************************/
+uint64_t NextDirtyVMPage(const TOYVM* vm, uint64_t page);
+
+/*******************************************************************************
+* Clears the dirty page bitmap.                                                *
+*******************************************************************************/
+void ClearVMDirtyPages(TOYVM* vm);
+
 /*******************************************************************************
 * Writes a single word 'value' (32-bit signed integer) at address 'address'.   *
 *******************************************************************************/
-void WriteWord(TOYVM* vm, int32_t address, int32_t value);
+void WriteWord(TOYVM* vm, vm_address address, int32_t value);
 
 /*******************************************************************************
-* Prints the status of the machine to stdout.                                  *
+* Prints the status of the machine to 'vm->output'.                            *
 *******************************************************************************/
 void PrintStatus(TOYVM* vm);
 
 /*******************************************************************************
-* Runs the virtual machine.                                                    *
+* Runs the virtual machine on the engine selected by 'vm->engine':             *
+*                                                                              *
+* ENGINE_INTERPRETER checks every instruction on every execution.              *
+*                                                                              *
+* ENGINE_QUICKENING validates the operands of an instruction the first time it *
+* runs at a given address and caches the result in 'quick_code', so later     *
+* executions skip the checks. Writes through WriteWord() and WriteVMMemory()   *
+* drop the cached entries they overlap; memory written directly through        *
+* 'memory' must be in place before RunVM() is first called.                    *
+*                                                                              *
+* ENGINE_AUTO starts in the interpreter and switches to quickening once the    *
+* program has run long enough to pay for the 'quick_code' table, so short     *
+* runs never allocate it.                                                      *
+*                                                                              *
+* Every engine stops after 'fuel' instructions and subtracts the instructions  *
+* it executed (not counting the one that halted or faulted), so 'fuel' is 0    *
+* after RunVM() exactly when the program ran out of fuel.                      *
 *******************************************************************************/
 void RunVM(TOYVM* vm);
 
+/*******************************************************************************
+* The number of machines RunVMLanes() runs side by side.                       *
+*******************************************************************************/
+#ifndef MINVM_LANES
+#define MINVM_LANES 8
+#endif
+
+/*******************************************************************************
+* Runs the 'count' machines in 'vms' as if RunVM() were called on each of      *
+* them, MINVM_LANES at a time: each stops on the same instruction with the     *
+* same 'fuel' left as RunVM() would leave it, on any engine. While the         *
+* machines of a group stand on the same instruction, it is fetched and         *
+* checked once and executed for all of them in a loop over registers kept side *
+* by side, which the compiler vectorises. When a conditional branch sends them *
+* different ways, the machines furthest behind are stepped one at a time until *
+* the group meets again.                                                       *
+*                                                                              *
+* The machines must hold the same 'code_size' bytes of code at address 0, and  *
+* lockstep stops for good once any of them writes to that code. They run on    *
+* the checking interpreter whatever their 'engine'. Built with                 *
+* -DMINVM_GUARD_PAGE, -DMINVM_PROFILE or -DMINVM_COVERAGE, the machines run    *
+* one after another.                                                           *
+*******************************************************************************/
+void RunVMLanes(TOYVM* vms[], size_t count, size_t code_size);
+
+#ifdef MINVM_PROFILE
+/*******************************************************************************
+* Prints the 'top' most frequently executed pairs of consecutive opcodes, one  *
+* "COUNT FIRST SECOND" line per pair. The lines of several runs can be summed  *
+* to pick new superinstructions. Available when built with -DMINVM_PROFILE;    *
+* superinstruction fusion is disabled in that build so every opcode counts.    *
+*******************************************************************************/
+void PrintProfile(TOYVM* vm, size_t top);
+#endif
+
 void Put(TOYVM vm, int idx);
 
 #endif /* MINVM_H */
@@ -0,0 +1,266 @@
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "minvm.h"
+#include "minvm_protocol.h"
+
+/*******************************************************************************
+* minvm_client: sends a program (and optionally an input file) to a running    *
+* minvm_server, prints what the guest printed and, like toy, the status of     *
+* the machine if the guest faulted. With --repeat=N the request is sent N      *
+* times over one connection and the mean round trip is reported on stderr;     *
+* with --cached only the first of them carries the program, the others name    *
+* it by id.                                                                    *
+*******************************************************************************/
+
+//把整个文件读入内存，失败时返回 NULL
+static uint8_t* readFile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "r");
+    
+    if (!file)
+    {
+        printf("ERROR: cannot read file \"%s\".\n", path);
+        return NULL;
+    }
+    
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    
+    uint8_t* data = (uint8_t*)malloc(*size + 1);
+    
+    if (data != NULL && fread(data, 1, *size, file) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    
+    fclose(file);
+    return data;
+}
+
+static bool readFully(int fd, void* buffer, size_t size)
+{
+    uint8_t* bytes = buffer;
+    
+    while (size != 0)
+    {
+        ssize_t received = read(fd, bytes, size);
+        
+        if (received <= 0)
+        {
+            return false;
+        }
+        
+        bytes += received;
+        size  -= received;
+    }
+    
+    return true;
+}
+
+static bool writeFully(int fd, const void* buffer, size_t size)
+{
+    const uint8_t* bytes = buffer;
+    
+    while (size != 0)
+    {
+        ssize_t sent = write(fd, bytes, size);
+        
+        if (sent < 0)
+        {
+            return false;
+        }
+        
+        bytes += sent;
+        size  -= sent;
+    }
+    
+    return true;
+}
+
+//解析 --engine= 选项，无法识别时返回 -1
+static int parseEngine(const char* name)
+{
+    if (strcmp(name, "auto") == 0)
+    {
+        return ENGINE_AUTO;
+    }
+    
+    if (strcmp(name, "interpreter") == 0)
+    {
+        return ENGINE_INTERPRETER;
+    }
+    
+    if (strcmp(name, "quick") == 0)
+    {
+        return ENGINE_QUICKENING;
+    }
+    
+    return -1;
+}
+
+//读取一个请求的所有应答帧，输出打印到 stdout，成功时把结果存入 result
+static bool receiveResult(int fd, MINVM_RESULT* result)
+{
+    char buffer[4096];
+    MINVM_FRAME_HEADER header;
+    
+    while (readFully(fd, &header, sizeof(header)))
+    {
+        if (header.type == MINVM_FRAME_STATUS)
+        {
+            return header.size == sizeof(*result)
+                && readFully(fd, result, sizeof(*result));
+        }
+        
+        for (uint32_t left = header.size; left != 0;)
+        {
+            uint32_t chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+            
+            if (!readFully(fd, buffer, chunk))
+            {
+                return false;
+            }
+            
+            fwrite(buffer, 1, chunk, header.type == MINVM_FRAME_OUTPUT
+                                     ? stdout : stderr);
+            left -= chunk;
+        }
+        
+        if (header.type == MINVM_FRAME_ERROR)
+        {
+            fputc('\n', stderr);
+            return false;
+        }
+    }
+    
+    return false;
+}
+
+int main(int argc, const char * argv[]) {
+    MINVM_REQUEST request = { .magic = MINVM_PROTOCOL_MAGIC };
+    long repeat = 1;
+    bool cached = false;
+    
+    for (; argc > 3 && strncmp(argv[1], "--", 2) == 0; ++argv, --argc)
+    {
+        if (strncmp(argv[1], "--engine=", 9) == 0)
+        {
+            request.engine = parseEngine(argv[1] + 9);
+        }
+        else if (strncmp(argv[1], "--fuel=", 7) == 0)
+        {
+            request.fuel = strtoull(argv[1] + 7, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--memory=", 9) == 0)
+        {
+            request.memory_size = (uint32_t) strtoul(argv[1] + 9, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--repeat=", 9) == 0)
+        {
+            repeat = strtol(argv[1] + 9, NULL, 10);
+        }
+        else if (strcmp(argv[1], "--cached") == 0)
+        {
+            cached = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    
+    if ((argc != 3 && argc != 4) || request.engine < 0 || repeat <= 0)
+    {
+        puts("Usage: minvm_client [--engine=auto|interpreter|quick] "
+             "[--fuel=N] [--memory=BYTES] [--repeat=N] [--cached] "
+             "SOCKET FILE.brick [INPUT]\n");
+        return 0;
+    }
+    
+    size_t program_size;
+    size_t input_size = 0;
+    uint8_t* program = readFile(argv[2], &program_size);
+    uint8_t* input   = argc == 4 ? readFile(argv[3], &input_size) : NULL;
+    
+    if (program == NULL || (argc == 4 && input == NULL))
+    {
+        return (EXIT_FAILURE);
+    }
+    
+    request.program_size = (uint32_t) program_size;
+    request.input_size   = (uint32_t) input_size;
+    HashProgram(program, program_size, request.program_id);
+    
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (fd < 0
+        || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
+    {
+        printf("ERROR: cannot connect to \"%s\".\n", argv[1]);
+        return (EXIT_FAILURE);
+    }
+    
+    MINVM_RESULT result;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    for (long i = 0; i < repeat; ++i)
+    {
+        //服务器拒绝请求时会先发回错误帧再断开，写失败也要读出它
+        bool sent = writeFully(fd, &request, sizeof(request))
+                 && writeFully(fd, program, program_size)
+                 && writeFully(fd, input, input_size);
+        
+        if (!receiveResult(fd, &result) || !sent)
+        {
+            return (EXIT_FAILURE);
+        }
+        
+        //--cached 时只有第一个请求发送程序，之后的请求只发送程序的 id
+        if (cached)
+        {
+            request.program_size = 0;
+            program_size         = 0;
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+    
+    if (repeat > 1)
+    {
+        double elapsed = (end.tv_sec - start.tv_sec)
+                       + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%ld requests, %.1f us per request\n",
+                repeat, elapsed / repeat * 1e6);
+    }
+    
+    if (result.fuel == 0)
+    {
+        puts("OUT OF FUEL");
+    }
+    
+    TOYVM vm;
+    vm.cpu    = result.cpu;
+    vm.output = stdout;
+    
+    if (vm.cpu.status.BAD_ACCESS
+        || vm.cpu.status.BAD_INSTRUCTION
+        || vm.cpu.status.INVALID_REGISTER_INDEX
+        || vm.cpu.status.STACK_OVERFLOW
+        || vm.cpu.status.STACK_UNDERFLOW)
+    {
+        PrintStatus(&vm);
+    }
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include "minvm.h"
+
+/*******************************************************************************
+* minvm_fuzz: an in-process fuzz target in the libFuzzer interface, built with *
+*                                                                              *
+*     clang -fsanitize=fuzzer,address minvm_fuzz.c minvm.c -o minvm_fuzz       *
+*                                                                              *
+* or, to replay inputs without libFuzzer, with any compiler and                *
+* -DMINVM_FUZZ_STANDALONE, in which case every argument is a file run as one   *
+* input.                                                                       *
+*                                                                              *
+* With MINVM_FUZZ_PROGRAM set to a .brick file, the target fuzzes that guest:  *
+* the machine is snapshotted once with the program loaded, and every input is  *
+* run from the snapshot the way toy --records= runs a record, placed after the *
+* program with REG1 holding its address and REG2 its size. A guest that        *
+* faults is reported as a crash.                                               *
+*                                                                              *
+* Otherwise the target fuzzes the VM itself: the input is the program, and     *
+* only a crash of the host counts. Its first byte picks the engine. Any memory *
+* mode may be fuzzed: guest accesses outside memory stop the guest with        *
+* BAD_ACCESS (or wrap, in the masked and paged modes) and never reach host     *
+* memory, so every sanitizer report is a bug in the VM.                        *
+*                                                                              *
+* Every run is limited to MINVM_FUZZ_FUEL instructions (100000 by default);    *
+* running out of fuel is not a crash. Inputs longer than MINVM_FUZZ_MAX_INPUT  *
+* bytes (4096 by default) are skipped. What the guest prints is discarded.     *
+*                                                                              *
+* Built with -DMINVM_COVERAGE as well, the edge coverage of the guest is       *
+* handed to libFuzzer as extra counters, so inputs that take new paths through *
+* the guest are kept even when they take no new path through the VM.           *
+*******************************************************************************/
+
+#ifdef MINVM_COVERAGE
+//libFuzzer 在每次执行前清零这个段，执行后把其中的字节当作覆盖率计数器
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t coverage_map[MINVM_COVERAGE_MAP_SIZE];
+#endif
+
+static struct {
+    TOYVM       vm;
+    VM_SNAPSHOT snapshot;
+    bool        has_program; /* Fuzzing the guest in MINVM_FUZZ_PROGRAM. */
+    size_t      program_size;
+    size_t      max_input;
+} fuzz;
+
+//读取环境变量中的数值，没有设置时返回 fallback
+static uint64_t getEnvNumber(const char* name, uint64_t fallback)
+{
+    const char* value = getenv(name);
+    return value != NULL ? strtoull(value, NULL, 10) : fallback;
+}
+
+//把整个文件读入内存，失败时返回 NULL
+static uint8_t* readFile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "r");
+    
+    if (!file)
+    {
+        return NULL;
+    }
+    
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    
+    uint8_t* data = (uint8_t*)malloc(*size + 1);
+    
+    if (data != NULL && fread(data, 1, *size, file) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    
+    fclose(file);
+    return data;
+}
+
+static bool hasFaulted(const TOYVM* vm)
+{
+    return vm->cpu.status.BAD_ACCESS
+        || vm->cpu.status.BAD_INSTRUCTION
+        || vm->cpu.status.INVALID_REGISTER_INDEX
+        || vm->cpu.status.STACK_OVERFLOW
+        || vm->cpu.status.STACK_UNDERFLOW;
+}
+
+/*******************************************************************************
+* 初始化虚拟机并做快照，之后每个输入都从这个快照开始执行，不再重新初始化、装入 *
+* 和校验程序。与 toy 一样，内存的后一半是栈。                                   *
+*******************************************************************************/
+int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+    const char* program_path = getenv("MINVM_FUZZ_PROGRAM");
+    uint8_t* program = NULL;
+    
+    fuzz.max_input = getEnvNumber("MINVM_FUZZ_MAX_INPUT", 4096);
+    
+    if (program_path != NULL)
+    {
+        program = readFile(program_path, &fuzz.program_size);
+        
+        if (program == NULL)
+        {
+            fprintf(stderr, "ERROR: cannot read file \"%s\".\n", program_path);
+            exit(EXIT_FAILURE);
+        }
+        
+        fuzz.has_program = true;
+    }
+    
+    vm_address data_size = (vm_address) (fuzz.program_size + fuzz.max_input);
+    
+    bool ready = InitializeVM(&fuzz.vm, 2 * data_size, data_size);
+    
+    fuzz.vm.output = fopen("/dev/null", "w");
+    fuzz.vm.fuel   = getEnvNumber("MINVM_FUZZ_FUEL", 100000);
+#ifdef MINVM_COVERAGE
+    fuzz.vm.coverage_map = coverage_map;
+#endif
+    
+    if (ready && program != NULL)
+    {
+        VM_IMAGE image;
+        ready = CreateVMImage(&image, program, fuzz.program_size);
+        
+        if (ready)
+        {
+            LoadVMImage(&fuzz.vm, &image);
+            FreeVMImage(&image);
+        }
+        
+        free(program);
+    }
+    
+    if (!ready || fuzz.vm.output == NULL
+        || !SnapshotVM(&fuzz.vm, &fuzz.snapshot))
+    {
+        fputs("ERROR: out of memory.\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    TOYVM* vm = &fuzz.vm;
+    
+    if (size > fuzz.max_input || (!fuzz.has_program && size == 0))
+    {
+        return 0;
+    }
+    
+    RestoreVMSnapshot(vm, &fuzz.snapshot);
+    
+    if (fuzz.has_program)
+    {
+        WriteVMMemoryAt(vm, (vm_address) fuzz.program_size, data, size);
+        vm->cpu.registers[REG1] = (int32_t) fuzz.program_size;
+        vm->cpu.registers[REG2] = (int32_t) size;
+    }
+    else
+    {
+        //第一个字节选择引擎，其余的字节是程序
+        vm->engine = data[0] % 3;
+        WriteVMMemory(vm, (uint8_t*) data + 1, size - 1);
+    }
+    
+    RunVM(vm);
+    
+    if (fuzz.has_program && hasFaulted(vm))
+    {
+        FILE* output = vm->output;
+        vm->output = stderr;
+        PrintStatus(vm);
+        vm->output = output;
+        abort();
+    }
+    
+    return 0;
+}
+
+#ifdef MINVM_FUZZ_STANDALONE
+int main(int argc, char* argv[])
+{
+    LLVMFuzzerInitialize(&argc, &argv);
+    
+    for (int i = 1; i < argc; ++i)
+    {
+        size_t size;
+        uint8_t* data = readFile(argv[i], &size);
+        
+        if (data == NULL)
+        {
+            fprintf(stderr, "ERROR: cannot read file \"%s\".\n", argv[i]);
+            return (EXIT_FAILURE);
+        }
+        
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    
+    return 0;
+}
+#endif
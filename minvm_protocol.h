@@ -0,0 +1,181 @@
+#ifndef MINVM_PROTOCOL_H
+#define MINVM_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include "minvm.h"
+
+/*******************************************************************************
+* Wire protocol between minvm_server and its clients over a Unix domain        *
+* socket. Both ends run on the same host and are built from the same headers,  *
+* so all integers are sent in host byte order and structures are sent as is.  *
+*                                                                              *
+* A client sends a MINVM_REQUEST followed by 'program_size' bytes of program   *
+* and 'input_size' bytes of input. The server answers with any number of       *
+* MINVM_FRAME_OUTPUT frames carrying what the guest printed, as it prints it,  *
+* followed by exactly one MINVM_FRAME_STATUS frame carrying a MINVM_RESULT, or *
+* by one MINVM_FRAME_ERROR frame carrying a message if the request was         *
+* rejected. A connection may carry any number of requests, one after another. *
+*                                                                              *
+* Every request names its program by 'program_id', the HashProgram() of the   *
+* program bytes. The server caches programs by id: a request may leave out the *
+* program bytes ('program_size' 0) to run a program the server has already    *
+* seen, and requests for the same program are steered to the same worker.     *
+* The id is a SHA-256 digest, so no client can make another client's id name  *
+* a program of its own choosing.                                               *
+*                                                                              *
+* The program is loaded at address 0 and the input right after it; the guest   *
+* starts with REG1 holding the address of the input and REG2 its size. The     *
+* top quarter of the memory is the stack.                                      *
+*******************************************************************************/
+#define MINVM_PROTOCOL_MAGIC 0x334d564du /* "MVM3" */
+
+enum {
+    MINVM_FRAME_OUTPUT = 0x01,
+    MINVM_FRAME_STATUS = 0x02,
+    MINVM_FRAME_ERROR  = 0x03,
+    
+    MINVM_PROGRAM_ID_SIZE = 32,
+};
+
+typedef struct MINVM_REQUEST {
+    uint32_t magic;
+    uint32_t program_size; /* 0 to run the cached program 'program_id'.     */
+    uint32_t input_size;
+    uint32_t memory_size;  /* 0 selects the default of the server.          */
+    int32_t  engine;       /* ENGINE_AUTO, ENGINE_INTERPRETER or            *
+                            * ENGINE_QUICKENING.                            */
+    uint32_t reserved;
+    uint64_t fuel;         /* Instruction limit; 0 means the server's.      */
+    uint8_t  program_id[MINVM_PROGRAM_ID_SIZE]; /* HashProgram() of the      *
+                                                 * program.                  */
+} MINVM_REQUEST;
+
+typedef struct MINVM_FRAME_HEADER {
+    uint32_t type;
+    uint32_t size;         /* Number of payload bytes that follow.          */
+} MINVM_FRAME_HEADER;
+
+typedef struct MINVM_RESULT {
+    VM_CPU   cpu;
+    uint64_t fuel;         /* Fuel left; 0 if the guest ran out of fuel.    */
+} MINVM_RESULT;
+
+static inline uint32_t RotateRight32(uint32_t value, int count)
+{
+    return (value >> count) | (value << (32 - count));
+}
+
+//SHA-256 的压缩函数，处理一个 64 字节的块
+static inline void CompressProgramBlock(uint32_t state[8],
+                                        const uint8_t block[64])
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t w[64];
+    uint32_t v[8];
+    
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16
+             | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18)
+                    ^ (w[i - 15] >> 3);
+        uint32_t s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19)
+                    ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    for (int i = 0; i < 8; ++i)
+    {
+        v[i] = state[i];
+    }
+    
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = RotateRight32(v[4], 6) ^ RotateRight32(v[4], 11)
+                    ^ RotateRight32(v[4], 25);
+        uint32_t t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6]))
+                    + k[i] + w[i];
+        uint32_t s0 = RotateRight32(v[0], 2) ^ RotateRight32(v[0], 13)
+                    ^ RotateRight32(v[0], 22);
+        uint32_t t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + t2;
+    }
+    
+    for (int i = 0; i < 8; ++i)
+    {
+        state[i] += v[i];
+    }
+}
+
+/*******************************************************************************
+* 程序的 SHA-256 散列值，用作程序的 id。服务器只凭 id 就运行缓存的程序，所以 id *
+* 必须抗碰撞：FNV-1a 之类的散列很容易构造出两个 id 相同的程序。               *
+*******************************************************************************/
+static inline void HashProgram(const uint8_t* program, size_t size,
+                               uint8_t id[MINVM_PROGRAM_ID_SIZE])
+{
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    uint8_t block[64];
+    size_t  offset = 0;
+    
+    for (; size - offset >= sizeof(block); offset += sizeof(block))
+    {
+        CompressProgramBlock(state, program + offset);
+    }
+    
+    //最后不足一块的部分补上 0x80、若干个零和以位计的长度（大端序）
+    size_t left = size - offset;
+    uint64_t bits = (uint64_t) size * 8;
+    
+    memset(block, 0, sizeof(block));
+    memcpy(block, program + offset, left);
+    block[left] = 0x80;
+    
+    if (left >= sizeof(block) - 8)
+    {
+        CompressProgramBlock(state, block);
+        memset(block, 0, sizeof(block));
+    }
+    
+    for (int i = 0; i < 8; ++i)
+    {
+        block[63 - i] = (uint8_t) (bits >> (8 * i));
+    }
+    
+    CompressProgramBlock(state, block);
+    
+    for (int i = 0; i < MINVM_PROGRAM_ID_SIZE; ++i)
+    {
+        id[i] = (uint8_t) (state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+#endif /* MINVM_PROTOCOL_H */
@@ -0,0 +1,829 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "minvm.h"
+#include "minvm_protocol.h"
+
+/*******************************************************************************
+* minvm_server: runs guest programs for clients connecting over a Unix domain  *
+* socket, see minvm_protocol.h. Each worker thread owns one virtual machine    *
+* that is initialised once at start-up and reset between requests, so a       *
+* request costs a reset and a copy of the program instead of a process start,  *
+* a file open and InitializeVM().                                              *
+*                                                                              *
+* Programs are cached by id as validated VM_IMAGEs shared by all workers, and  *
+* every program id has an owning worker: a request for a program owned by     *
+* another worker is handed over to it together with its connection, so the    *
+* requests for one program run back to back on one worker whose caches and    *
+* branch predictors are warm for it. A worker that already has                 *
+* AFFINITY_BACKLOG connections waiting does not receive more, and the request  *
+* then runs where it was read. A worker with connections waiting serves them  *
+* in turn, one request each, so no connection holds up the others.             *
+*                                                                              *
+* A request may ask for at most --max-memory=BYTES of guest memory (64 MiB by  *
+* default); larger requests, and requests whose machine cannot be allocated,   *
+* are answered with an error frame.                                            *
+* Likewise a request may run at most --max-fuel=N instructions (a billion by   *
+* default): a request without a fuel limit gets that one, and a request asking *
+* for more is answered with an error frame.                                    *
+*                                                                              *
+* With --release-idle=SECONDS a worker that has had no work for that long      *
+* resets its machine and gives its memory back with ReleaseVMMemory(), so a    *
+* host can keep many more idle workers than it could keep busy ones. SIGUSR1   *
+* prints on stderr how many workers are idle and how much memory they gave     *
+* back, and how much KSM has merged where the kernel reports it.               *
+*******************************************************************************/
+enum {
+    DEFAULT_WORKERS       = 4,
+    DEFAULT_MEMORY_SIZE   = 64 * 1024,
+    DEFAULT_MAX_MEMORY    = 64 * 1024 * 1024,
+    DEFAULT_MAX_FUEL      = 1000000000,
+    CONNECTION_QUEUE_SIZE = 256,
+    PENDING_QUEUE_SIZE    = 8,
+    AFFINITY_BACKLOG      = 2,
+    IMAGE_CACHE_SIZE      = 256,
+    OUTPUT_BUFFER_SIZE    = 4096,
+};
+
+//等待某个工作线程处理的连接，has_request 为 true 时请求头已经读出
+typedef struct pending_request {
+    int           fd;
+    bool          has_request;
+    MINVM_REQUEST request;
+} pending_request;
+
+typedef struct worker {
+    pthread_t       thread;
+    TOYVM           vm;
+    uint32_t        memory_size; /* The size 'vm' was initialised for, 0 if *
+                                  * that failed.                           */
+    uint8_t*        payload;     /* Program and input of a request.        */
+    size_t          payload_capacity;
+    pending_request pending[PENDING_QUEUE_SIZE]; /* Guarded by            *
+                                                  * 'scheduler.lock'.     */
+    size_t          pending_head;
+    size_t          pending_count;
+    bool            idle;     /* Released since its last request; both     *
+                               * guarded by 'scheduler.lock'.               */
+    size_t          released; /* Bytes ReleaseVMMemory() gave back then.   */
+} worker;
+
+static uint32_t default_memory_size = DEFAULT_MEMORY_SIZE;
+static uint32_t max_memory_size     = DEFAULT_MAX_MEMORY;
+static uint64_t max_fuel            = DEFAULT_MAX_FUEL;
+static worker*  workers;
+static size_t   n_workers = DEFAULT_WORKERS;
+static unsigned release_idle; /* Seconds; 0 never releases. */
+
+static volatile sig_atomic_t report_requested;
+
+//已经接受、等待工作线程处理的连接
+static struct {
+    int             fds[CONNECTION_QUEUE_SIZE];
+    size_t          head;
+    size_t          count;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  not_full;
+} scheduler = {
+    .lock     = PTHREAD_MUTEX_INITIALIZER,
+    .work     = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void PushConnection(int fd)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    
+    while (scheduler.count == CONNECTION_QUEUE_SIZE)
+    {
+        pthread_cond_wait(&scheduler.not_full, &scheduler.lock);
+    }
+    
+    scheduler.fds[(scheduler.head + scheduler.count)
+                  % CONNECTION_QUEUE_SIZE] = fd;
+    scheduler.count++;
+    pthread_cond_broadcast(&scheduler.work);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+static void PushPendingLocked(worker* w, int fd, const MINVM_REQUEST* request)
+{
+    pending_request* slot = &w->pending[(w->pending_head + w->pending_count)
+                                        % PENDING_QUEUE_SIZE];
+    slot->fd          = fd;
+    slot->has_request = request != NULL;
+    
+    if (request != NULL)
+    {
+        slot->request = *request;
+    }
+    
+    w->pending_count++;
+    pthread_cond_broadcast(&scheduler.work);
+}
+
+//把连接连同已经读出的请求头交给 owner，owner 等待的连接已经够多时返回 false
+static bool HandOver(worker* owner, int fd, const MINVM_REQUEST* request)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    
+    bool accepted = owner->pending_count < AFFINITY_BACKLOG;
+    
+    if (accepted)
+    {
+        PushPendingLocked(owner, fd, request);
+    }
+    
+    pthread_mutex_unlock(&scheduler.lock);
+    return accepted;
+}
+
+//有其他连接在等待 w 时把连接排到它们后面，返回 true；否则返回 false
+static bool Yield(worker* w, int fd)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    
+    bool yielded = w->pending_count != 0
+                && w->pending_count < PENDING_QUEUE_SIZE;
+    
+    if (yielded)
+    {
+        PushPendingLocked(w, fd, NULL);
+    }
+    
+    pthread_mutex_unlock(&scheduler.lock);
+    return yielded;
+}
+
+//重置空闲的工作线程的虚拟机并交还它的内存，调用时持有 scheduler.lock
+static void ReleaseIdleVMLocked(worker* w)
+{
+    pthread_mutex_unlock(&scheduler.lock);
+    
+    size_t released = 0;
+    
+    if (w->memory_size != 0)
+    {
+        ResetVM(&w->vm);
+        released = ReleaseVMMemory(&w->vm);
+    }
+    
+    pthread_mutex_lock(&scheduler.lock);
+    
+    w->idle     = true;
+    w->released = released;
+}
+
+//取下一个要处理的连接，优先处理交给自己的连接
+static pending_request NextWork(worker* w)
+{
+    pending_request work = { .has_request = false };
+    pthread_mutex_lock(&scheduler.lock);
+    
+    while (w->pending_count == 0 && scheduler.count == 0)
+    {
+        if (release_idle == 0 || w->idle)
+        {
+            pthread_cond_wait(&scheduler.work, &scheduler.lock);
+            continue;
+        }
+        
+        //等了 release_idle 秒还没有工作时交还内存，之后不再限时等待
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += release_idle;
+        
+        if (pthread_cond_timedwait(&scheduler.work, &scheduler.lock,
+                                   &deadline) == ETIMEDOUT
+            && w->pending_count == 0 && scheduler.count == 0)
+        {
+            ReleaseIdleVMLocked(w);
+        }
+    }
+    
+    w->idle     = false;
+    w->released = 0;
+    
+    if (w->pending_count != 0)
+    {
+        work = w->pending[w->pending_head];
+        w->pending_head = (w->pending_head + 1) % PENDING_QUEUE_SIZE;
+        w->pending_count--;
+    }
+    else
+    {
+        work.fd = scheduler.fds[scheduler.head];
+        scheduler.head = (scheduler.head + 1) % CONNECTION_QUEUE_SIZE;
+        scheduler.count--;
+        pthread_cond_signal(&scheduler.not_full);
+    }
+    
+    pthread_mutex_unlock(&scheduler.lock);
+    return work;
+}
+
+/*******************************************************************************
+* 程序缓存：按程序 id 直接映射的表，表项带引用计数。表本身持有一个引用，正在运 *
+* 行该程序的每个请求各持有一个引用；表项被同一位置的新程序替换后，最后一个引  *
+* 用释放时映像才被释放。                                                       *
+*******************************************************************************/
+typedef struct cached_image {
+    uint8_t  id[MINVM_PROGRAM_ID_SIZE];
+    VM_IMAGE image;
+    int      references; /* Guarded by 'image_cache.lock'. */
+} cached_image;
+
+//id 的前 8 个字节，用来选择缓存的位置和程序所属的工作线程
+static uint64_t GetIdKey(const uint8_t* id)
+{
+    uint64_t key;
+    memcpy(&key, id, sizeof(key));
+    return key;
+}
+
+static struct {
+    cached_image*   slots[IMAGE_CACHE_SIZE];
+    pthread_mutex_t lock;
+} image_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void ReleaseImageLocked(cached_image* image)
+{
+    if (--image->references == 0)
+    {
+        FreeVMImage(&image->image);
+        free(image);
+    }
+}
+
+static void ReleaseImage(cached_image* image)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    ReleaseImageLocked(image);
+    pthread_mutex_unlock(&image_cache.lock);
+}
+
+//查找缓存的程序，找不到时返回 NULL
+static cached_image* AcquireImage(const uint8_t* id)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    
+    cached_image* image = image_cache.slots[GetIdKey(id) % IMAGE_CACHE_SIZE];
+    
+    if (image != NULL && memcmp(image->id, id, MINVM_PROGRAM_ID_SIZE) == 0)
+    {
+        image->references++;
+    }
+    else
+    {
+        image = NULL;
+    }
+    
+    pthread_mutex_unlock(&image_cache.lock);
+    return image;
+}
+
+//校验程序并加入缓存，返回持有一个引用的表项，内存不足时返回 NULL
+static cached_image* AddImage(const uint8_t* id, const uint8_t* code,
+                              size_t size)
+{
+    cached_image* image = malloc(sizeof(cached_image));
+    
+    if (image == NULL || !CreateVMImage(&image->image, code, size))
+    {
+        free(image);
+        return NULL;
+    }
+    
+    memcpy(image->id, id, MINVM_PROGRAM_ID_SIZE);
+    image->references = 2;
+    
+    pthread_mutex_lock(&image_cache.lock);
+    
+    cached_image** slot = &image_cache.slots[GetIdKey(id) % IMAGE_CACHE_SIZE];
+    
+    if (*slot != NULL)
+    {
+        ReleaseImageLocked(*slot);
+    }
+    
+    *slot = image;
+    pthread_mutex_unlock(&image_cache.lock);
+    return image;
+}
+
+static bool ReadFully(int fd, void* buffer, size_t size)
+{
+    uint8_t* bytes = buffer;
+    
+    while (size != 0)
+    {
+        ssize_t received = read(fd, bytes, size);
+        
+        if (received <= 0)
+        {
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            
+            return false;
+        }
+        
+        bytes += received;
+        size  -= received;
+    }
+    
+    return true;
+}
+
+static bool WriteFully(int fd, const void* buffer, size_t size)
+{
+    const uint8_t* bytes = buffer;
+    
+    while (size != 0)
+    {
+        ssize_t sent = write(fd, bytes, size);
+        
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            
+            return false;
+        }
+        
+        bytes += sent;
+        size  -= sent;
+    }
+    
+    return true;
+}
+
+//头部和数据用一次 writev 发出，只有在少见的部分写入时才补发剩下的部分
+static bool SendFrame(int fd, uint32_t type, const void* payload, size_t size)
+{
+    MINVM_FRAME_HEADER header = { type, (uint32_t) size };
+    struct iovec parts[2] = {
+        { &header,         sizeof(header) },
+        { (void*) payload, size           },
+    };
+    
+    ssize_t sent = writev(fd, parts, 2);
+    
+    if (sent == (ssize_t)(sizeof(header) + size))
+    {
+        return true;
+    }
+    
+    if (sent < 0)
+    {
+        if (errno != EINTR)
+        {
+            return false;
+        }
+        
+        sent = 0;
+    }
+    
+    if ((size_t) sent < sizeof(header))
+    {
+        if (!WriteFully(fd, (uint8_t*) &header + sent, sizeof(header) - sent))
+        {
+            return false;
+        }
+        
+        sent = sizeof(header);
+    }
+    
+    sent -= sizeof(header);
+    return WriteFully(fd, (const uint8_t*) payload + sent, size - sent);
+}
+
+static bool SendError(int fd, const char* message)
+{
+    return SendFrame(fd, MINVM_FRAME_ERROR, message, strlen(message));
+}
+
+//客机的输出经过缓冲后，每次刷新作为一个 MINVM_FRAME_OUTPUT 帧发给客户端
+static ssize_t WriteOutputFrame(void* cookie, const char* data, size_t size)
+{
+    int fd = *(int*) cookie;
+    return SendFrame(fd, MINVM_FRAME_OUTPUT, data, size) ? (ssize_t) size : -1;
+}
+
+//栈占内存的最后四分之一
+static uint32_t GetStackLimit(uint32_t memory_size)
+{
+    return memory_size - memory_size / 4;
+}
+
+//大小相同时复用工作线程的虚拟机，否则重新初始化；内存不足时返回 false
+static bool PrepareVM(worker* w, uint32_t memory_size)
+{
+    if (w->memory_size == memory_size)
+    {
+        ResetVM(&w->vm);
+        return true;
+    }
+    
+    FreeVM(&w->vm);
+    
+    bool initialized = InitializeVM(&w->vm,
+                                    memory_size,
+                                    GetStackLimit(memory_size));
+    
+    w->memory_size = initialized ? memory_size : 0;
+    return initialized;
+}
+
+/*******************************************************************************
+* 执行一个请求头已经读出的请求。返回 false 时连接不能再继续使用（客户端断开、写 *
+* 失败或请求不合法），由调用者关闭。                                           *
+*******************************************************************************/
+static bool RunRequest(worker* w, int fd, FILE* output,
+                       const MINVM_REQUEST* request)
+{
+    if (request->magic != MINVM_PROTOCOL_MAGIC)
+    {
+        SendError(fd, "bad request magic");
+        return false;
+    }
+    
+    uint32_t memory_size = request->memory_size != 0
+                         ? request->memory_size
+                         : default_memory_size;
+    uint64_t payload_size = (uint64_t) request->program_size
+                          + request->input_size;
+    
+    if (memory_size > max_memory_size)
+    {
+        SendError(fd, "memory size exceeds the server's limit");
+        return false;
+    }
+    
+    if (request->fuel > max_fuel)
+    {
+        SendError(fd, "fuel exceeds the server's limit");
+        return false;
+    }
+    
+    //程序和输入必须放在栈的下方
+    if (payload_size > GetStackLimit(memory_size))
+    {
+        SendError(fd, "program and input do not fit in memory");
+        return false;
+    }
+    
+    if (request->engine != ENGINE_AUTO
+        && request->engine != ENGINE_INTERPRETER
+        && request->engine != ENGINE_QUICKENING)
+    {
+        SendError(fd, "unknown engine");
+        return false;
+    }
+    
+    if (payload_size > w->payload_capacity)
+    {
+        uint8_t* payload = realloc(w->payload, payload_size);
+        
+        if (payload == NULL)
+        {
+            SendError(fd, "out of memory");
+            return false;
+        }
+        
+        w->payload          = payload;
+        w->payload_capacity = payload_size;
+    }
+    
+    if (!ReadFully(fd, w->payload, payload_size))
+    {
+        return false;
+    }
+    
+    //以下的错误发生时请求已经完整读出，连接仍然可以继续使用
+    cached_image* image;
+    const uint8_t* input = w->payload + request->program_size;
+    
+    if (request->program_size == 0)
+    {
+        image = AcquireImage(request->program_id);
+        
+        if (image == NULL)
+        {
+            return SendError(fd, "unknown program");
+        }
+        
+        if (image->image.size + request->input_size
+            > GetStackLimit(memory_size))
+        {
+            ReleaseImage(image);
+            return SendError(fd, "program and input do not fit in memory");
+        }
+    }
+    else
+    {
+        uint8_t id[MINVM_PROGRAM_ID_SIZE];
+        HashProgram(w->payload, request->program_size, id);
+        
+        if (memcmp(id, request->program_id, MINVM_PROGRAM_ID_SIZE) != 0)
+        {
+            return SendError(fd, "program id does not match the program");
+        }
+        
+        image = AcquireImage(request->program_id);
+        
+        //只运行与客户端发来的程序逐字节相同的映像，不同时当作未命中
+        if (image != NULL
+            && (image->image.size != request->program_size
+                || memcmp(image->image.code, w->payload,
+                          request->program_size) != 0))
+        {
+            ReleaseImage(image);
+            image = NULL;
+        }
+        
+        if (image == NULL)
+        {
+            image = AddImage(request->program_id,
+                             w->payload,
+                             request->program_size);
+        }
+        
+        if (image == NULL)
+        {
+            return SendError(fd, "out of memory");
+        }
+    }
+    
+    if (!PrepareVM(w, memory_size))
+    {
+        ReleaseImage(image);
+        return SendError(fd, "out of memory");
+    }
+    
+    w->vm.engine = request->engine;
+    LoadVMImage(&w->vm, &image->image);
+    WriteVMMemoryAt(&w->vm,
+                    (vm_address) image->image.size,
+                    input,
+                    request->input_size);
+    
+    w->vm.cpu.registers[REG1] = (int32_t) image->image.size;
+    w->vm.cpu.registers[REG2] = (int32_t) request->input_size;
+    w->vm.fuel   = request->fuel != 0 ? request->fuel : max_fuel;
+    w->vm.output = output;
+    
+    RunVM(&w->vm);
+    ReleaseImage(image);
+    
+    if (fflush(output) != 0)
+    {
+        return false;
+    }
+    
+    MINVM_RESULT result = { w->vm.cpu, w->vm.fuel };
+    return SendFrame(fd, MINVM_FRAME_STATUS, &result, sizeof(result));
+}
+
+/*******************************************************************************
+* 处理一个连接上的请求，直到连接不可用、某个请求交给了它的程序所属的工作线程， *
+* 或者有其他连接在等待。'first' 不为 NULL 时是已经读出的第一个请求头。          *
+*******************************************************************************/
+static void ServeConnection(worker* w, int fd, const MINVM_REQUEST* first)
+{
+    cookie_io_functions_t functions = { .write = WriteOutputFrame };
+    FILE* output = fopencookie(&fd, "w", functions);
+    bool passed_on = false;
+    
+    if (output == NULL)
+    {
+        close(fd);
+        return;
+    }
+    
+    setvbuf(output, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    
+    MINVM_REQUEST request;
+    bool has_request = first != NULL;
+    
+    if (has_request)
+    {
+        request = *first;
+    }
+    
+    while (has_request || ReadFully(fd, &request, sizeof(request)))
+    {
+        has_request = false;
+        
+        worker* owner = &workers[GetIdKey(request.program_id) % n_workers];
+        
+        if (owner != w && HandOver(owner, fd, &request))
+        {
+            passed_on = true;
+            break;
+        }
+        
+        if (!RunRequest(w, fd, output, &request))
+        {
+            break;
+        }
+        
+        if (Yield(w, fd))
+        {
+            passed_on = true;
+            break;
+        }
+    }
+    
+    //每个请求结束时输出都已刷新，这里不会再发出数据
+    w->vm.output = stdout;
+    fclose(output);
+    
+    if (!passed_on)
+    {
+        close(fd);
+    }
+}
+
+static void RequestReport(int signal_number)
+{
+    report_requested = 1;
+}
+
+//打印空闲的工作线程交还了多少内存；内核报告 KSM 合并的页时一并打印
+static void PrintReport(void)
+{
+    size_t idle     = 0;
+    size_t released = 0;
+    
+    pthread_mutex_lock(&scheduler.lock);
+    
+    for (size_t i = 0; i < n_workers; ++i)
+    {
+        idle     += workers[i].idle;
+        released += workers[i].released;
+    }
+    
+    pthread_mutex_unlock(&scheduler.lock);
+    
+    fprintf(stderr, "%zu of %zu workers idle, %zu KiB released",
+            idle, n_workers, released / 1024);
+    
+    FILE* ksm = fopen("/proc/self/ksm_merging_pages", "r");
+    long merged;
+    
+    if (ksm != NULL && fscanf(ksm, "%ld", &merged) == 1)
+    {
+        fprintf(stderr, ", %ld KiB merged by KSM",
+                merged * (sysconf(_SC_PAGESIZE) / 1024));
+    }
+    
+    if (ksm != NULL)
+    {
+        fclose(ksm);
+    }
+    
+    fputc('\n', stderr);
+}
+
+static void* RunWorker(void* argument)
+{
+    worker* w = argument;
+    
+    while (true)
+    {
+        pending_request work = NextWork(w);
+        ServeConnection(w, work.fd, work.has_request ? &work.request : NULL);
+    }
+    
+    return NULL;
+}
+
+int main(int argc, const char * argv[]) {
+    for (; argc > 2 && strncmp(argv[1], "--", 2) == 0; ++argv, --argc)
+    {
+        if (strncmp(argv[1], "--workers=", 10) == 0)
+        {
+            n_workers = strtoul(argv[1] + 10, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--memory=", 9) == 0)
+        {
+            default_memory_size = (uint32_t) strtoul(argv[1] + 9, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--max-memory=", 13) == 0)
+        {
+            max_memory_size = (uint32_t) strtoul(argv[1] + 13, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--max-fuel=", 11) == 0)
+        {
+            max_fuel = strtoull(argv[1] + 11, NULL, 10);
+        }
+        else if (strncmp(argv[1], "--release-idle=", 15) == 0)
+        {
+            release_idle = (unsigned) strtoul(argv[1] + 15, NULL, 10);
+        }
+        else
+        {
+            break;
+        }
+    }
+    
+    if (argc != 2 || n_workers == 0 || default_memory_size == 0
+        || max_memory_size > INT32_MAX
+        || default_memory_size > max_memory_size || max_fuel == 0)
+    {
+        puts("Usage: minvm_server [--workers=N] [--memory=BYTES] "
+             "[--max-memory=BYTES] [--max-fuel=N] [--release-idle=SECONDS] "
+             "SOCKET\n");
+        return 0;
+    }
+    
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    
+    if (strlen(argv[1]) >= sizeof(address.sun_path))
+    {
+        printf("ERROR: socket path \"%s\" is too long.\n", argv[1]);
+        return (EXIT_FAILURE);
+    }
+    
+    strcpy(address.sun_path, argv[1]);
+    
+    //客户端提前断开时 write 返回错误，而不是终止进程
+    signal(SIGPIPE, SIG_IGN);
+    
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argv[1]);
+    
+    if (listen_fd < 0
+        || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        perror("ERROR: cannot listen");
+        return (EXIT_FAILURE);
+    }
+    
+    //工作线程屏蔽 SIGUSR1，由主线程处理，信号打断 accept 后打印报告
+    struct sigaction report_action = { .sa_handler = RequestReport };
+    sigset_t report_signal;
+    
+    sigemptyset(&report_signal);
+    sigaddset(&report_signal, SIGUSR1);
+    sigaction(SIGUSR1, &report_action, NULL);
+    pthread_sigmask(SIG_BLOCK, &report_signal, NULL);
+    
+    //预先初始化每个工作线程的虚拟机
+    workers = calloc(n_workers, sizeof(worker));
+    
+    for (size_t i = 0; i < n_workers; ++i)
+    {
+        if (!InitializeVM(&workers[i].vm,
+                          default_memory_size,
+                          GetStackLimit(default_memory_size)))
+        {
+            puts("ERROR: out of memory.");
+            return (EXIT_FAILURE);
+        }
+        
+        workers[i].memory_size = default_memory_size;
+        pthread_create(&workers[i].thread, NULL, RunWorker, &workers[i]);
+    }
+    
+    pthread_sigmask(SIG_UNBLOCK, &report_signal, NULL);
+    
+    while (true)
+    {
+        if (report_requested)
+        {
+            report_requested = 0;
+            PrintReport();
+        }
+        
+        int fd = accept(listen_fd, NULL, NULL);
+        
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            
+            perror("ERROR: accept");
+            return (EXIT_FAILURE);
+        }
+        
+        PushConnection(fd);
+    }
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <string.h>
+#include "../minvm.h"
+
+/*******************************************************************************
+* engines_test: runs every test program on the interpreter, the quickened      *
+* engine (with and without a program image), ENGINE_AUTO and RunVMLanes() and  *
+* checks that all of them stop in the same CPU state with the same fuel left,  *
+* for a range of fuel limits, including the programs that fault. Built and run *
+* in every memory mode by tests/run.sh.                                        *
+*******************************************************************************/
+
+enum {
+    TEST_MEMORY_SIZE = 32768,
+    TEST_STACK_LIMIT = 16384,
+    TEST_LANES       = 3,
+    MAX_FUEL         = 64,
+    
+    /* Enough for every terminating program; 'spin' never halts and is run     *
+     * with this much fuel instead of UINT64_MAX.                             */
+    LONG_FUEL        = 100000,
+};
+
+typedef struct test_program {
+    const char*    name;
+    const uint8_t* code;
+    size_t         size;
+} test_program;
+
+static int failures;
+
+//算术指令
+static const uint8_t arithmetic[] = {
+    CONST, REG1, 7, 0, 0, 0,
+    CONST, REG2, 0xfd, 0xff, 0xff, 0xff,
+    ADD,   REG1, REG2,
+    MUL,   REG2, REG1,
+    NEG,   REG2,
+    CONST, REG3, 5, 0, 0, 0,
+    MOD,   REG3, REG1,
+    DIV,   REG3, REG2,
+    HALT,
+};
+
+//用 LOOP 求 1 到 10 的和，再用 CMP 和条件跳转检查结果
+static const uint8_t branches[] = {
+    CONST, REG1, 10, 0, 0, 0,
+    CONST, REG2, 0, 0, 0, 0,
+    ADD,   REG1, REG2,
+    LOOP,  REG1, 12, 0, 0, 0,
+    CONST, REG3, 55, 0, 0, 0,
+    CMP,   REG2, REG3,
+    JE,    36, 0, 0, 0,
+    NOP,
+    CMP,   REG3, REG2,
+    JA,    0, 0, 0, 0,
+    JB,    0, 0, 0, 0,
+    CONST, REG4, 1, 0, 0, 0,
+    HALT,
+};
+
+//嵌套的 CALL 和 RET
+static const uint8_t call_ret[] = {
+    CONST, REG1, 3, 0, 0, 0,
+    CALL,  13, 0, 0, 0,
+    HALT,
+    NOP,
+    ADD,   REG1, REG1,
+    CALL,  22, 0, 0, 0,
+    RET,
+    NEG,   REG1,
+    RET,
+};
+
+//各种读写内存和栈的指令
+static const uint8_t memory[] = {
+    CONST,    REG1, 0x34, 0x12, 0, 0,
+    STORE,    REG1, 0x00, 0x20, 0, 0,
+    LOAD,     REG2, 0x00, 0x20, 0, 0,
+    CONST,    REG3, 0x04, 0x20, 0, 0,
+    RSTORE,   REG2, REG3,
+    RLOAD,    REG3, REG4,
+    STOREW,   REG4, 0x00, 0x21, 0, 0, 0, 0, 0, 0,
+    LOADW,    REG1, 0x00, 0x21, 0, 0, 0, 0, 0, 0,
+    PUSH_ALL,
+    LSP,      REG2,
+    POP_ALL,
+    HALT,
+};
+
+//第一遍执行之后改写 CONST 的操作数，第二遍要执行改写过的指令
+static const uint8_t self_modifying[] = {
+    CONST, REG1, 2, 0, 0, 0,
+    CONST, REG3, 7, 0, 0, 0,
+    CONST, REG4, 9, 0, 0, 0,
+    STORE, REG4, 8, 0, 0, 0,
+    LOOP,  REG1, 6, 0, 0, 0,
+    HALT,
+};
+
+//死循环，只会因为燃料耗尽而停下
+static const uint8_t spin[] = {
+    JMP, 0, 0, 0, 0,
+};
+
+//空栈上 POP、RET
+static const uint8_t pop_empty[] = {
+    POP, REG1,
+    HALT,
+};
+
+static const uint8_t ret_empty[] = {
+    RET,
+};
+
+//未定义的操作码和无效的寄存器
+static const uint8_t bad_instruction[] = {
+    NOP,
+    0xff,
+};
+
+static const uint8_t invalid_register[] = {
+    CONST, 7, 0, 0, 0, 0,
+    HALT,
+};
+
+//LOAD 的地址超出内存
+static const uint8_t load_out_of_range[] = {
+    LOAD, REG1, 0x00, 0x00, 0xff, 0x7f,
+    HALT,
+};
+
+//JMP 到负地址
+static const uint8_t jump_negative[] = {
+    JMP, 0xf0, 0xff, 0xff, 0xff,
+    HALT,
+};
+
+//各通道同步执行到 JB 时一起跳到负地址
+static const uint8_t branch_negative[] = {
+    CONST, REG1, 1, 0, 0, 0,
+    CONST, REG2, 2, 0, 0, 0,
+    CMP,   REG1, REG2,
+    JB,    0x00, 0x00, 0x00, 0x80,
+    HALT,
+};
+
+//LOOP 跳到负地址
+static const uint8_t loop_negative[] = {
+    CONST, REG1, 5, 0, 0, 0,
+    LOOP,  REG1, 0xfc, 0xff, 0xff, 0xff,
+    HALT,
+};
+
+//RLOAD、RSTORE 的地址寄存器为负数
+static const uint8_t register_address_negative[] = {
+    CONST,  REG1, 0xfc, 0xff, 0xff, 0xff,
+    RLOAD,  REG1, REG2,
+    RSTORE, REG2, REG1,
+    HALT,
+};
+
+//PUSH 之后紧跟 POP，合并成寄存器复制
+static const uint8_t push_pop[] = {
+    CONST, REG1, 7, 0, 0, 0,
+    PUSH,  REG1,
+    POP,   REG2,
+    HALT,
+};
+
+//把栈压满之后再 PUSH、POP：不能合并，要报告 STACK_OVERFLOW
+static const uint8_t push_pop_full_stack[] = {
+    CONST, REG1, 0x00, 0x10, 0, 0,
+    PUSH,  REG1,
+    LOOP,  REG1, 6, 0, 0, 0,
+    PUSH,  REG2,
+    POP,   REG3,
+    HALT,
+};
+
+//NOP ... NOP HALT，比一页长，在 main 中填写
+static uint8_t long_program[9001];
+
+static const test_program programs[] = {
+    { "arithmetic",                arithmetic,
+      sizeof(arithmetic) },
+    { "branches",                  branches,
+      sizeof(branches) },
+    { "call_ret",                  call_ret,
+      sizeof(call_ret) },
+    { "memory",                    memory,
+      sizeof(memory) },
+    { "self_modifying",            self_modifying,
+      sizeof(self_modifying) },
+    { "spin",                      spin,
+      sizeof(spin) },
+    { "pop_empty",                 pop_empty,
+      sizeof(pop_empty) },
+    { "ret_empty",                 ret_empty,
+      sizeof(ret_empty) },
+    { "bad_instruction",           bad_instruction,
+      sizeof(bad_instruction) },
+    { "invalid_register",          invalid_register,
+      sizeof(invalid_register) },
+    { "load_out_of_range",         load_out_of_range,
+      sizeof(load_out_of_range) },
+    { "jump_negative",             jump_negative,
+      sizeof(jump_negative) },
+    { "branch_negative",           branch_negative,
+      sizeof(branch_negative) },
+    { "loop_negative",             loop_negative,
+      sizeof(loop_negative) },
+    { "register_address_negative", register_address_negative,
+      sizeof(register_address_negative) },
+    { "push_pop",                  push_pop,
+      sizeof(push_pop) },
+    { "push_pop_full_stack",       push_pop_full_stack,
+      sizeof(push_pop_full_stack) },
+    { "long_program",              long_program,
+      sizeof(long_program) },
+};
+
+static bool loadProgram(TOYVM* vm, const test_program* program, int engine,
+                        uint64_t fuel)
+{
+    if (!InitializeVM(vm, TEST_MEMORY_SIZE, TEST_STACK_LIMIT))
+    {
+        return false;
+    }
+    
+    WriteVMMemoryAt(vm, 0, program->code, program->size);
+    vm->engine = engine;
+    vm->fuel   = fuel;
+    return true;
+}
+
+static bool sameState(const TOYVM* a, const TOYVM* b)
+{
+    return memcmp(a->cpu.registers, b->cpu.registers,
+                  sizeof(a->cpu.registers)) == 0
+        && a->cpu.program_counter == b->cpu.program_counter
+        && a->cpu.stack_pointer   == b->cpu.stack_pointer
+        && memcmp(&a->cpu.status, &b->cpu.status, sizeof(a->cpu.status)) == 0
+        && a->fuel == b->fuel;
+}
+
+static void reportMismatch(const test_program* program, const char* engine,
+                           uint64_t fuel, const TOYVM* expected,
+                           const TOYVM* actual)
+{
+    fprintf(stderr,
+            "FAIL %s on %s with fuel %llu: pc %lld/%lld, fuel %llu/%llu\n",
+            program->name, engine, (unsigned long long) fuel,
+            (long long) actual->cpu.program_counter,
+            (long long) expected->cpu.program_counter,
+            (unsigned long long) actual->fuel,
+            (unsigned long long) expected->fuel);
+    ++failures;
+}
+
+static void checkProgram(const test_program* program, uint64_t fuel)
+{
+    static const struct {
+        int         engine;
+        const char* name;
+    } engines[] = {
+        { ENGINE_QUICKENING, "quick" },
+        { ENGINE_AUTO,       "auto" },
+    };
+    
+    TOYVM expected;
+    
+    if (!loadProgram(&expected, program, ENGINE_INTERPRETER, fuel))
+    {
+        fprintf(stderr, "FAIL %s: out of memory\n", program->name);
+        ++failures;
+        return;
+    }
+    
+    RunVM(&expected);
+    
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+    {
+        TOYVM vm;
+        
+        if (loadProgram(&vm, program, engines[e].engine, fuel))
+        {
+            RunVM(&vm);
+            
+            if (!sameState(&expected, &vm))
+            {
+                reportMismatch(program, engines[e].name, fuel, &expected, &vm);
+            }
+        }
+        
+        FreeVM(&vm);
+    }
+    
+    TOYVM  lanes[TEST_LANES];
+    TOYVM* vms[TEST_LANES];
+    
+    for (size_t l = 0; l < TEST_LANES; ++l)
+    {
+        loadProgram(&lanes[l], program, ENGINE_INTERPRETER, fuel);
+        vms[l] = &lanes[l];
+    }
+    
+    RunVMLanes(vms, TEST_LANES, program->size);
+    
+    for (size_t l = 0; l < TEST_LANES; ++l)
+    {
+        if (!sameState(&expected, &lanes[l]))
+        {
+            reportMismatch(program, "lanes", fuel, &expected, &lanes[l]);
+        }
+        
+        FreeVM(&lanes[l]);
+    }
+    
+    VM_IMAGE image;
+    TOYVM    vm;
+    
+    if (!CreateVMImage(&image, program->code, program->size))
+    {
+        fprintf(stderr, "FAIL %s: cannot create an image\n", program->name);
+        ++failures;
+    }
+    else
+    {
+        if (loadProgram(&vm, program, ENGINE_QUICKENING, fuel))
+        {
+            LoadVMImage(&vm, &image);
+            RunVM(&vm);
+            
+            if (!sameState(&expected, &vm))
+            {
+                reportMismatch(program, "image", fuel, &expected, &vm);
+            }
+        }
+        
+        FreeVM(&vm);
+        FreeVMImage(&image);
+    }
+    
+    FreeVM(&expected);
+}
+
+int main(void)
+{
+    size_t n_programs = sizeof(programs) / sizeof(programs[0]);
+    
+    memset(long_program, NOP, sizeof(long_program) - 1);
+    long_program[sizeof(long_program) - 1] = HALT;
+    
+    for (size_t p = 0; p < n_programs; ++p)
+    {
+        for (uint64_t fuel = 1; fuel <= MAX_FUEL; ++fuel)
+        {
+            checkProgram(&programs[p], fuel);
+        }
+        
+        checkProgram(&programs[p], LONG_FUEL);
+        
+        if (programs[p].code != spin)
+        {
+            checkProgram(&programs[p], UINT64_MAX);
+        }
+    }
+    
+    printf("engines_test: %d failure(s)\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <string.h>
+#include "../minvm.h"
+
+/*******************************************************************************
+* faults_test: runs programs that fault, or run out of fuel, on every engine   *
+* and checks that each stops with the right status flag and the program        *
+* counter on the faulting instruction. Built and run in every memory mode by   *
+* tests/run.sh.                                                                *
+*******************************************************************************/
+
+enum {
+    TEST_MEMORY_SIZE = 32768,
+    TEST_STACK_LIMIT = 16384,
+    TEST_LANES       = 2,
+    TEST_FUEL        = 100000,
+};
+
+typedef enum fault {
+    FAULT_NONE,
+    FAULT_BAD_INSTRUCTION,
+    FAULT_STACK_UNDERFLOW,
+    FAULT_STACK_OVERFLOW,
+    FAULT_INVALID_REGISTER_INDEX,
+    FAULT_BAD_ACCESS,
+} fault;
+
+typedef struct fault_case {
+    const char*    name;
+    const uint8_t* code;
+    size_t         size;
+    vm_address     from_end;  /* Load the code this many bytes before the      *
+                               * end of memory instead of at address 0.       */
+    uint64_t       fuel;
+    fault          expected;
+    vm_address     expected_pc; /* Relative to where the code was loaded.     */
+} fault_case;
+
+static int failures;
+
+static const uint8_t halt[] = {
+    HALT,
+};
+
+static const uint8_t pop_empty[] = {
+    POP, REG1,
+    HALT,
+};
+
+static const uint8_t ret_empty[] = {
+    RET,
+};
+
+//栈上只有一个字时 POP_ALL
+static const uint8_t pop_all_short[] = {
+    PUSH,    REG1,
+    POP_ALL,
+    HALT,
+};
+
+//不停地压栈、递归，直到栈满
+static const uint8_t push_full[] = {
+    PUSH, REG1,
+    JMP,  0, 0, 0, 0,
+};
+
+static const uint8_t call_full[] = {
+    CALL, 0, 0, 0, 0,
+};
+
+static const uint8_t bad_instruction[] = {
+    NOP,
+    0xff,
+};
+
+static const uint8_t invalid_register[] = {
+    CONST, 7, 0, 0, 0, 0,
+    HALT,
+};
+
+static const uint8_t jump_outside[] = {
+    JMP, 0x00, 0x00, 0xff, 0x7f,
+};
+
+//屏蔽和分页内存模式下越界的地址不出错，见 load_out_of_range 的用法
+static const uint8_t load_out_of_range[] = {
+    LOAD, REG1, 0x00, 0x00, 0xff, 0x7f,
+    HALT,
+};
+
+//放在内存的最后两个字节上，操作数超出内存
+static const uint8_t truncated[] = {
+    CONST, REG1,
+};
+
+static const uint8_t spin[] = {
+    JMP, 0, 0, 0, 0,
+};
+
+static const fault_case cases[] = {
+    { "halt",              halt,              sizeof(halt),
+      0, TEST_FUEL, FAULT_NONE,                   0 },
+    { "pop_empty",         pop_empty,         sizeof(pop_empty),
+      0, TEST_FUEL, FAULT_STACK_UNDERFLOW,        0 },
+    { "ret_empty",         ret_empty,         sizeof(ret_empty),
+      0, TEST_FUEL, FAULT_STACK_UNDERFLOW,        0 },
+    { "pop_all_short",     pop_all_short,     sizeof(pop_all_short),
+      0, TEST_FUEL, FAULT_STACK_UNDERFLOW,        2 },
+    { "push_full",         push_full,         sizeof(push_full),
+      0, TEST_FUEL, FAULT_STACK_OVERFLOW,         0 },
+    { "call_full",         call_full,         sizeof(call_full),
+      0, TEST_FUEL, FAULT_STACK_OVERFLOW,         0 },
+    { "bad_instruction",   bad_instruction,   sizeof(bad_instruction),
+      0, TEST_FUEL, FAULT_BAD_INSTRUCTION,        1 },
+    { "invalid_register",  invalid_register,  sizeof(invalid_register),
+      0, TEST_FUEL, FAULT_INVALID_REGISTER_INDEX, 0 },
+    { "jump_outside",      jump_outside,      sizeof(jump_outside),
+      0, TEST_FUEL, FAULT_BAD_ACCESS,             0x7fff0000 },
+#if !defined(MINVM_MASKED_MEMORY) && !defined(MINVM_PAGED_MEMORY)
+    { "load_out_of_range", load_out_of_range, sizeof(load_out_of_range),
+      0, TEST_FUEL, FAULT_BAD_ACCESS,             0 },
+#endif
+    { "truncated",         truncated,         sizeof(truncated),
+      2, TEST_FUEL, FAULT_BAD_ACCESS,             0 },
+    { "out_of_fuel",       spin,              sizeof(spin),
+      0, 10,        FAULT_NONE,                   0 },
+};
+
+//虚拟机停下时设置的出错标志位；设置了多个时返回 FAULT_NONE 以外的任意一个
+static fault getFault(const TOYVM* vm)
+{
+    return vm->cpu.status.BAD_INSTRUCTION        ? FAULT_BAD_INSTRUCTION
+         : vm->cpu.status.STACK_UNDERFLOW        ? FAULT_STACK_UNDERFLOW
+         : vm->cpu.status.STACK_OVERFLOW         ? FAULT_STACK_OVERFLOW
+         : vm->cpu.status.INVALID_REGISTER_INDEX ? FAULT_INVALID_REGISTER_INDEX
+         : vm->cpu.status.BAD_ACCESS             ? FAULT_BAD_ACCESS
+         :                                         FAULT_NONE;
+}
+
+//装入 c 的代码，返回代码的地址；内存不足时返回 -1
+static vm_address loadCase(TOYVM* vm, const fault_case* c, int engine)
+{
+    if (!InitializeVM(vm, TEST_MEMORY_SIZE, TEST_STACK_LIMIT))
+    {
+        return -1;
+    }
+    
+    vm_address address = c->from_end != 0 ? vm->memory_size - c->from_end : 0;
+    
+    WriteVMMemoryAt(vm, address, c->code, c->size);
+    vm->cpu.program_counter = address;
+    vm->engine = engine;
+    vm->fuel   = c->fuel;
+    return address;
+}
+
+static void checkCase(const fault_case* c, const char* engine,
+                      const TOYVM* vm, vm_address address)
+{
+    //只有燃料耗尽的例子会用完燃料
+    bool out_of_fuel = vm->fuel == 0;
+    bool expected_out_of_fuel = c->code == spin;
+    
+    if (getFault(vm) != c->expected
+        || vm->cpu.program_counter != address + c->expected_pc
+        || out_of_fuel != expected_out_of_fuel)
+    {
+        fprintf(stderr,
+                "FAIL %s on %s: fault %d/%d, pc %lld/%lld, fuel %llu\n",
+                c->name, engine, (int) getFault(vm), (int) c->expected,
+                (long long) vm->cpu.program_counter,
+                (long long) (address + c->expected_pc),
+                (unsigned long long) vm->fuel);
+        ++failures;
+    }
+}
+
+static void runCase(const fault_case* c)
+{
+    static const struct {
+        int         engine;
+        const char* name;
+    } engines[] = {
+        { ENGINE_INTERPRETER, "interpreter" },
+        { ENGINE_QUICKENING,  "quick" },
+        { ENGINE_AUTO,        "auto" },
+    };
+    
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+    {
+        TOYVM vm;
+        vm_address address = loadCase(&vm, c, engines[e].engine);
+        
+        if (address < 0)
+        {
+            fprintf(stderr, "FAIL %s: out of memory\n", c->name);
+            ++failures;
+            continue;
+        }
+        
+        RunVM(&vm);
+        checkCase(c, engines[e].name, &vm, address);
+        FreeVM(&vm);
+    }
+    
+    TOYVM      lanes[TEST_LANES];
+    TOYVM*     vms[TEST_LANES];
+    vm_address addresses[TEST_LANES];
+    
+    for (size_t l = 0; l < TEST_LANES; ++l)
+    {
+        addresses[l] = loadCase(&lanes[l], c, ENGINE_INTERPRETER);
+        vms[l] = &lanes[l];
+    }
+    
+    RunVMLanes(vms, TEST_LANES, c->from_end != 0 ? 0 : c->size);
+    
+    for (size_t l = 0; l < TEST_LANES; ++l)
+    {
+        checkCase(c, "lanes", &lanes[l], addresses[l]);
+        FreeVM(&lanes[l]);
+    }
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        runCase(&cases[i]);
+    }
+    
+    printf("faults_test: %d failure(s)\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
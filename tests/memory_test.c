@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include "../minvm.h"
+
+/*******************************************************************************
+* memory_test: what one guest writes must not be visible to the next guest    *
+* run on the same machine after ResetVM() or RestoreVMSnapshot(), including    *
+* words that straddle the end of memory. Built and run in every memory mode   *
+* by tests/run.sh.                                                             *
+*******************************************************************************/
+
+enum {
+    TEST_MEMORY_SIZE = 8192,
+    TEST_STACK_LIMIT = 4096,
+    WORD_PATTERN     = 0x11223344,
+    
+    /* Where runLoad() puts its code, clear of the bytes a word at the end of  *
+     * memory wraps onto in the masked mode.                                  */
+    LOAD_CODE_ADDRESS = 0x100,
+};
+
+static int failures;
+
+#define CHECK(condition)                                                       \
+    do                                                                         \
+    {                                                                          \
+        if (!(condition))                                                      \
+        {                                                                      \
+            fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__,           \
+                    #condition);                                               \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (0)
+
+//把 value 按小端序写到 code 中
+static void putWord(uint8_t* code, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        code[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+//CONST REG1 WORD_PATTERN; STORE REG1 address; LOAD REG2 address; HALT
+static void runStore(TOYVM* vm, uint32_t address)
+{
+    uint8_t code[19] = {
+        CONST, REG1, 0, 0, 0, 0,
+        STORE, REG1, 0, 0, 0, 0,
+        LOAD,  REG2, 0, 0, 0, 0,
+        HALT,
+    };
+    
+    putWord(code + 2,  WORD_PATTERN);
+    putWord(code + 8,  address);
+    putWord(code + 14, address);
+    WriteVMMemory(vm, code, sizeof(code));
+    RunVM(vm);
+}
+
+//从 LOAD_CODE_ADDRESS 开始执行 LOAD REG2 address; HALT。返回读到的字，越界时
+//返回 0
+static int32_t runLoad(TOYVM* vm, uint32_t address)
+{
+    uint8_t code[7] = { LOAD, REG2, 0, 0, 0, 0, HALT };
+    
+    putWord(code + 2, address);
+    WriteVMMemoryAt(vm, LOAD_CODE_ADDRESS, code, sizeof(code));
+    vm->cpu.program_counter = LOAD_CODE_ADDRESS;
+    RunVM(vm);
+    return vm->cpu.status.BAD_ACCESS ? 0 : vm->cpu.registers[REG2];
+}
+
+//在内存最后的几个地址上写一个字，ResetVM 之后这些地址读出的都是零
+static void testResetClearsEndOfMemory(void)
+{
+    TOYVM vm;
+    CHECK(InitializeVM(&vm, TEST_MEMORY_SIZE, TEST_STACK_LIMIT));
+    
+    for (uint32_t back = 1; back <= 4; ++back)
+    {
+        uint32_t address = (uint32_t) vm.memory_size - back;
+        
+        ResetVM(&vm);
+        runStore(&vm, address);
+        ResetVM(&vm);
+        CHECK(runLoad(&vm, address) == 0);
+        
+        ResetVM(&vm);
+        CHECK(runLoad(&vm, 0x40) == 0);
+    }
+    
+    FreeVM(&vm);
+}
+
+//同样的写入在恢复快照之后也看不到
+static void testRestoreClearsEndOfMemory(void)
+{
+    TOYVM       vm;
+    VM_SNAPSHOT snapshot;
+    uint32_t    address;
+    
+    CHECK(InitializeVM(&vm, TEST_MEMORY_SIZE, TEST_STACK_LIMIT));
+    CHECK(SnapshotVM(&vm, &snapshot));
+    address = (uint32_t) vm.memory_size - 1;
+    
+    runStore(&vm, address);
+    RestoreVMSnapshot(&vm, &snapshot);
+    CHECK(runLoad(&vm, address) == 0);
+    
+    FreeVMSnapshot(&snapshot);
+    FreeVM(&vm);
+}
+
+#ifdef MINVM_MASKED_MEMORY
+//屏蔽内存模式下跨过内存末尾的字折回内存开头
+static void testMaskedWordWraps(void)
+{
+    TOYVM vm;
+    CHECK(InitializeVM(&vm, TEST_MEMORY_SIZE, TEST_STACK_LIMIT));
+    
+    uint32_t address = (uint32_t) vm.memory_size - 1;
+    runStore(&vm, address);
+    CHECK(!vm.cpu.status.BAD_ACCESS);
+    CHECK(vm.memory[address] == (WORD_PATTERN & 0xff));
+    CHECK(vm.memory[2] == (WORD_PATTERN >> 24));
+    CHECK(vm.cpu.registers[REG2] == WORD_PATTERN);
+    FreeVM(&vm);
+}
+#endif
+
+int main(void)
+{
+    testResetClearsEndOfMemory();
+    testRestoreClearsEndOfMemory();
+#ifdef MINVM_MASKED_MEMORY
+    testMaskedWordWraps();
+#endif
+    
+    printf("memory_test: %d failure(s)\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Builds every tests/*_test.c against minvm.c in each memory mode and runs it.
+# minvm_server is built in the same mode for server_test, which finds it
+# through $MINVM_SERVER.
+# Usage: tests/run.sh [extra compiler flags], e.g. tests/run.sh -fsanitize=address
+set -e
+cd "$(dirname "$0")/.."
+
+CC=${CC:-cc}
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+status=0
+
+for mode in "" -DMINVM_GUARD_PAGE -DMINVM_PAGED_MEMORY -DMINVM_MASKED_MEMORY \
+            -DMINVM_WIDE_ADDRESS -DMINVM_LANES=4
+do
+    $CC -O1 -g -pthread $mode "$@" minvm_server.c minvm.c -o "$BUILD/minvm_server"
+    
+    for test in tests/*_test.c
+    do
+        name=$(basename "$test" .c)
+        echo "== $name ${mode:-(default)}"
+        $CC -O1 -g -pthread $mode "$@" "$test" minvm.c -o "$BUILD/$name"
+        MINVM_SERVER="$BUILD/minvm_server" "$BUILD/$name" || status=1
+    done
+done
+
+exit $status
@@ -0,0 +1,353 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../minvm.h"
+#include "../minvm_protocol.h"
+
+/*******************************************************************************
+* server_test: starts the minvm_server named by $MINVM_SERVER with small       *
+* limits and sends it requests over its socket: a miss and hits in the program *
+* cache, a program that does not match its id, and requests over the memory    *
+* and fuel limits. tests/run.sh builds the server in every memory mode and     *
+* runs this test against it.                                                   *
+*******************************************************************************/
+
+enum {
+    TEST_MAX_MEMORY  = 1024 * 1024,
+    TEST_MAX_FUEL    = 1000,
+    CONNECT_ATTEMPTS = 500, /* 10 ms apart. */
+    TEXT_CAPACITY    = 256,
+};
+
+typedef struct reply {
+    uint32_t     type; /* MINVM_FRAME_STATUS or MINVM_FRAME_ERROR; 0 if the *
+                        * server closed the connection.                    */
+    MINVM_RESULT result;
+    char         text[TEXT_CAPACITY]; /* What the guest printed, or the     *
+                                       * error message.                     */
+} reply;
+
+static int failures;
+static char socket_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+
+#define CHECK(condition)                                                       \
+    do                                                                         \
+    {                                                                          \
+        if (!(condition))                                                      \
+        {                                                                      \
+            fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__,           \
+                    #condition);                                               \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (0)
+
+//CONST REG1 42; PUSH REG1; INT 1; HALT
+static const uint8_t print_42[] = {
+    CONST, REG1, 42, 0, 0, 0,
+    PUSH,  REG1,
+    INT,   INTERRUPT_PRINT_INTEGER,
+    HALT,
+};
+
+//另一个程序，用来冒充 print_42 的 id
+static const uint8_t print_7[] = {
+    CONST, REG1, 7, 0, 0, 0,
+    PUSH,  REG1,
+    INT,   INTERRUPT_PRINT_INTEGER,
+    HALT,
+};
+
+static const uint8_t spin[] = {
+    JMP, 0, 0, 0, 0,
+};
+
+static pid_t startServer(const char* server)
+{
+    char max_memory[32];
+    char max_fuel[32];
+    
+    snprintf(max_memory, sizeof(max_memory), "--max-memory=%d",
+             TEST_MAX_MEMORY);
+    snprintf(max_fuel, sizeof(max_fuel), "--max-fuel=%d", TEST_MAX_FUEL);
+    
+    pid_t pid = fork();
+    
+    if (pid == 0)
+    {
+        execl(server, server, "--workers=2", max_memory, max_fuel,
+              socket_path, (char*) NULL);
+        _exit(127);
+    }
+    
+    return pid;
+}
+
+//连接服务器，服务器刚启动时等它开始监听；失败时返回 -1
+static int connectServer(void)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, socket_path);
+    
+    for (int attempt = 0; attempt < CONNECT_ATTEMPTS; ++attempt)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        
+        if (fd >= 0
+            && connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0)
+        {
+            return fd;
+        }
+        
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        
+        usleep(10000);
+    }
+    
+    return -1;
+}
+
+static bool writeFully(int fd, const void* buffer, size_t size)
+{
+    const uint8_t* bytes = buffer;
+    
+    while (size != 0)
+    {
+        ssize_t sent = write(fd, bytes, size);
+        
+        if (sent <= 0)
+        {
+            return false;
+        }
+        
+        bytes += sent;
+        size  -= sent;
+    }
+    
+    return true;
+}
+
+static bool readFully(int fd, void* buffer, size_t size)
+{
+    uint8_t* bytes = buffer;
+    
+    while (size != 0)
+    {
+        ssize_t received = read(fd, bytes, size);
+        
+        if (received <= 0)
+        {
+            return false;
+        }
+        
+        bytes += received;
+        size  -= received;
+    }
+    
+    return true;
+}
+
+//program 的请求，发送程序本身，其余字段取服务器的默认值
+static MINVM_REQUEST makeRequest(const uint8_t* program, size_t size)
+{
+    MINVM_REQUEST request = { .magic = MINVM_PROTOCOL_MAGIC };
+    
+    request.program_size = (uint32_t) size;
+    HashProgram(program, size, request.program_id);
+    return request;
+}
+
+//读出一个请求的所有帧，直到状态帧、错误帧或者连接断开
+static reply receiveReply(int fd)
+{
+    reply r;
+    size_t length = 0;
+    MINVM_FRAME_HEADER header;
+    
+    memset(&r, 0, sizeof(r));
+    
+    while (readFully(fd, &header, sizeof(header)))
+    {
+        if (header.type == MINVM_FRAME_STATUS)
+        {
+            if (header.size == sizeof(r.result)
+                && readFully(fd, &r.result, sizeof(r.result)))
+            {
+                r.type = MINVM_FRAME_STATUS;
+            }
+            
+            return r;
+        }
+        
+        //输出和错误消息都拼接到 text 中，超出的部分丢掉
+        for (uint32_t left = header.size; left != 0; --left)
+        {
+            char c;
+            
+            if (!readFully(fd, &c, 1))
+            {
+                return r;
+            }
+            
+            if (length < sizeof(r.text) - 1)
+            {
+                r.text[length++] = c;
+            }
+        }
+        
+        if (header.type == MINVM_FRAME_ERROR)
+        {
+            r.type = MINVM_FRAME_ERROR;
+            return r;
+        }
+    }
+    
+    return r;
+}
+
+//发送请求和 payload（程序字节），返回服务器的回复
+static reply sendRequest(int fd, const MINVM_REQUEST* request,
+                         const uint8_t* payload)
+{
+    //服务器拒绝请求时先发回错误帧再断开，写失败也要读出它
+    writeFully(fd, request, sizeof(*request));
+    writeFully(fd, payload, request->program_size);
+    return receiveReply(fd);
+}
+
+//第一次只用 id 请求时缓存未命中；发送过程序之后，同一连接和新的连接上只用 id
+//的请求都命中
+static void testCache(void)
+{
+    int fd = connectServer();
+    CHECK(fd >= 0);
+    
+    MINVM_REQUEST request = makeRequest(print_42, sizeof(print_42));
+    MINVM_REQUEST by_id   = request;
+    by_id.program_size = 0;
+    
+    reply r = sendRequest(fd, &by_id, NULL);
+    CHECK(r.type == MINVM_FRAME_ERROR);
+    CHECK(strcmp(r.text, "unknown program") == 0);
+    
+    r = sendRequest(fd, &request, print_42);
+    CHECK(r.type == MINVM_FRAME_STATUS);
+    CHECK(strcmp(r.text, "42") == 0);
+    
+    r = sendRequest(fd, &by_id, NULL);
+    CHECK(r.type == MINVM_FRAME_STATUS);
+    CHECK(strcmp(r.text, "42") == 0);
+    CHECK(r.result.cpu.registers[REG1] == 42);
+    close(fd);
+    
+    fd = connectServer();
+    CHECK(fd >= 0);
+    r = sendRequest(fd, &by_id, NULL);
+    CHECK(r.type == MINVM_FRAME_STATUS);
+    CHECK(strcmp(r.text, "42") == 0);
+    close(fd);
+}
+
+//发来的程序与请求中的 id 不符时不运行它，也不运行 id 对应的缓存映像
+static void testIdMismatch(void)
+{
+    int fd = connectServer();
+    CHECK(fd >= 0);
+    
+    MINVM_REQUEST request = makeRequest(print_42, sizeof(print_42));
+    reply r = sendRequest(fd, &request, print_7);
+    
+    CHECK(r.type == MINVM_FRAME_ERROR);
+    CHECK(strcmp(r.text, "program id does not match the program") == 0);
+    close(fd);
+}
+
+//超过 --max-memory、--max-fuel 的请求收到错误帧；不限燃料的请求按 --max-fuel
+//执行
+static void testLimits(void)
+{
+    int fd = connectServer();
+    CHECK(fd >= 0);
+    
+    MINVM_REQUEST request = makeRequest(print_42, sizeof(print_42));
+    request.memory_size = 2 * TEST_MAX_MEMORY;
+    
+    reply r = sendRequest(fd, &request, print_42);
+    CHECK(r.type == MINVM_FRAME_ERROR);
+    CHECK(strcmp(r.text, "memory size exceeds the server's limit") == 0);
+    
+    //拒绝之后服务器关闭连接
+    CHECK(receiveReply(fd).type == 0);
+    close(fd);
+    
+    fd = connectServer();
+    CHECK(fd >= 0);
+    request = makeRequest(print_42, sizeof(print_42));
+    request.fuel = TEST_MAX_FUEL + 1;
+    r = sendRequest(fd, &request, print_42);
+    CHECK(r.type == MINVM_FRAME_ERROR);
+    CHECK(strcmp(r.text, "fuel exceeds the server's limit") == 0);
+    close(fd);
+    
+    fd = connectServer();
+    CHECK(fd >= 0);
+    
+    //CONST、PUSH、INT 三条指令，HALT 不计在内
+    request.fuel = TEST_MAX_FUEL;
+    r = sendRequest(fd, &request, print_42);
+    CHECK(r.type == MINVM_FRAME_STATUS);
+    CHECK(r.result.fuel == TEST_MAX_FUEL - 3);
+    
+    request = makeRequest(spin, sizeof(spin));
+    r = sendRequest(fd, &request, spin);
+    CHECK(r.type == MINVM_FRAME_STATUS);
+    CHECK(r.result.fuel == 0);
+    CHECK(r.result.cpu.program_counter == 0);
+    
+    request.fuel = 10;
+    r = sendRequest(fd, &request, spin);
+    CHECK(r.type == MINVM_FRAME_STATUS);
+    CHECK(r.result.fuel == 0);
+    close(fd);
+}
+
+int main(void)
+{
+    const char* server = getenv("MINVM_SERVER");
+    
+    if (server == NULL)
+    {
+        fputs("server_test: MINVM_SERVER must name a minvm_server binary\n",
+              stderr);
+        return EXIT_FAILURE;
+    }
+    
+    snprintf(socket_path, sizeof(socket_path), "/tmp/minvm_server_test.%d",
+             (int) getpid());
+    signal(SIGPIPE, SIG_IGN);
+    
+    pid_t pid = startServer(server);
+    
+    if (pid < 0)
+    {
+        perror("server_test: fork");
+        return EXIT_FAILURE;
+    }
+    
+    testCache();
+    testIdMismatch();
+    testLimits();
+    
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(socket_path);
+    
+    printf("server_test: %d failure(s)\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}